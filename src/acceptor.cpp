@@ -0,0 +1,66 @@
+#include "acceptor.h"
+#include "client.h"
+#include "thread.h"
+
+#ifdef Q_OS_UNIX
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+Acceptor::Acceptor()
+{
+}
+
+bool Acceptor::open(quint16 port)
+{
+#ifdef SO_REUSEPORT
+    int fd = ::socket(AF_INET6, SOCK_STREAM, 0);
+
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    int on = 1;
+    int off = 0;
+
+    sockaddr_in6 addr = {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_port = htons(port);
+    addr.sin6_addr = in6addr_any;
+
+    if (::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+            || ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0
+            || ::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0
+            || ::bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+            || ::listen(fd, SOMAXCONN) < 0
+            || !setSocketDescriptor(fd))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    return true;
+#else
+    Q_UNUSED(port)
+    return false;
+#endif
+}
+
+void Acceptor::incomingConnection(qintptr handle)
+{
+    auto socket = new QTcpSocket;
+
+    if (!socket->setSocketDescriptor(handle))
+    {
+        delete socket;
+        return;
+    }
+
+    auto client = new Client;
+
+    Thread::attach(client);
+
+    client->run(socket);
+}
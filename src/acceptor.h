@@ -0,0 +1,18 @@
+#ifndef ACCEPTOR_H
+#define ACCEPTOR_H
+
+#include <QTcpServer>
+
+class Acceptor : public QTcpServer
+{
+    Q_OBJECT
+public:
+    explicit Acceptor();
+
+    bool open(quint16);
+
+protected:
+    void incomingConnection(qintptr) override;
+};
+
+#endif // ACCEPTOR_H
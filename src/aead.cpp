@@ -0,0 +1,221 @@
+#include "aead.h"
+#include "server.h"
+
+#include <QtDebug>
+#include <QElapsedTimer>
+#include <QStringList>
+
+#include <algorithm>
+#include <cstring>
+
+#include <cryptopp/aes.h>
+#include <cryptopp/chachapoly.h>
+#include <cryptopp/cpu.h>
+#include <cryptopp/gcm.h>
+using CryptoPP::AES;
+using CryptoPP::ChaCha20Poly1305;
+using CryptoPP::GCM;
+using CryptoPP::XChaCha20Poly1305;
+
+static constexpr int TAG_SIZE = 16;
+static constexpr int MAX_NONCE = 32;
+static constexpr int BENCHMARK_FRAME = 256;
+static constexpr int BENCHMARK_MS = 100;
+
+template<typename T>
+class Backend : public Aead
+{
+public:
+    int tagSize() const override
+    {
+        return TAG_SIZE;
+    }
+
+    int nonceSize() const override
+    {
+        return int(enc.DefaultIVLength());
+    }
+
+    void setKey(const QVector<quint8> &key) override
+    {
+        quint8 nonce[MAX_NONCE] = {};
+
+        enc.SetKeyWithIV(key.constData(), key.size(), nonce, enc.DefaultIVLength());
+        dec.SetKeyWithIV(key.constData(), key.size(), nonce, dec.DefaultIVLength());
+    }
+
+    void seal(quint8 *out, const quint8 *in, int length, quint8 *tag, const quint8 *nonce) override
+    {
+        enc.EncryptAndAuthenticate(out, tag, TAG_SIZE, nonce, int(enc.DefaultIVLength()), nullptr, 0, in, length);
+    }
+
+    bool open(quint8 *out, const quint8 *in, int length, const quint8 *tag, const quint8 *nonce) override
+    {
+        return dec.DecryptAndVerify(out, tag, TAG_SIZE, nonce, int(dec.DefaultIVLength()), nullptr, 0, in, length);
+    }
+
+private:
+    typename T::Encryption enc;
+    typename T::Decryption dec;
+};
+
+QList<QByteArray> Aead::offered;
+
+Aead::~Aead()
+{
+}
+
+void Aead::prepare()
+{
+    QStringList features;
+
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+    if (CryptoPP::HasSSE2())
+    {
+        features << "SSE2";
+    }
+
+    if (CryptoPP::HasSSSE3())
+    {
+        features << "SSSE3";
+    }
+
+    if (CryptoPP::HasAVX2())
+    {
+        features << "AVX2";
+    }
+
+    if (CryptoPP::HasAESNI())
+    {
+        features << "AES-NI";
+    }
+
+    if (CryptoPP::HasCLMUL())
+    {
+        features << "PCLMUL";
+    }
+#elif CRYPTOPP_BOOL_ARM32 || CRYPTOPP_BOOL_ARMV8
+    if (CryptoPP::HasNEON())
+    {
+        features << "NEON";
+    }
+
+    if (CryptoPP::HasAES())
+    {
+        features << "AES";
+    }
+
+    if (CryptoPP::HasPMULL())
+    {
+        features << "PMULL";
+    }
+#endif
+
+    qInfo().noquote() << "CPU features:" << (features.isEmpty() ? "none" : features.join(' '));
+
+    auto names = Server::getSettings().value("Aead").toStringList();
+
+    if (names.isEmpty() || names.contains("auto", Qt::CaseInsensitive))
+    {
+        QList<QPair<double, QByteArray>> ranking;
+
+        for (const auto &name : { "AES-256-GCM", "ChaCha20Poly1305", "XChaCha20Poly1305" })
+        {
+            auto rate = measure(name);
+
+            qInfo().noquote() << QString("%1: %2 packets/s").arg(name).arg(rate, 0, 'f', 0);
+
+            ranking.append(qMakePair(rate, QByteArray(name)));
+        }
+
+        std::stable_sort(ranking.begin(), ranking.end(), [ = ](const QPair<double, QByteArray> &a, const QPair<double, QByteArray> &b)
+        {
+            return a.first > b.first;
+        });
+
+        for (const auto &entry : ranking)
+        {
+            offered.append(entry.second);
+        }
+    }
+    else
+    {
+        for (const auto &name : names)
+        {
+            QScopedPointer<Aead> aead(create(name.toLatin1()));
+
+            if (aead.isNull())
+            {
+                Server::error(QString("Unknown AEAD backend %1").arg(name));
+            }
+
+            offered.append(name.toLatin1());
+        }
+    }
+
+    qInfo().noquote() << "AEAD:" << offered.join(' ');
+}
+
+Aead *Aead::create(const QByteArray &name)
+{
+    if (name == "XChaCha20Poly1305")
+    {
+        return new Backend<XChaCha20Poly1305>;
+    }
+
+    if (name == "ChaCha20Poly1305")
+    {
+        return new Backend<ChaCha20Poly1305>;
+    }
+
+    if (name == "AES-256-GCM")
+    {
+        return new Backend<GCM<AES>>;
+    }
+
+    return nullptr;
+}
+
+const QList<QByteArray> &Aead::getOffered()
+{
+    return offered;
+}
+
+bool Aead::isOffered(const QByteArray &name)
+{
+    return offered.contains(name);
+}
+
+double Aead::measure(const QByteArray &name)
+{
+    QScopedPointer<Aead> aead(create(name));
+
+    aead->setKey(QVector<quint8>(32, 0x5A));
+
+    QByteArray buffer(BENCHMARK_FRAME, 0);
+    auto data = reinterpret_cast<quint8 *>(buffer.data());
+
+    quint8 tag[TAG_SIZE];
+    quint8 nonce[MAX_NONCE] = {};
+
+    quint64 packets = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while (timer.elapsed() < BENCHMARK_MS)
+    {
+        memcpy(nonce, &packets, sizeof(packets));
+
+        aead->seal(data, data, BENCHMARK_FRAME, tag, nonce);
+
+        if (!aead->open(data, data, BENCHMARK_FRAME, tag, nonce))
+        {
+            return 0;
+        }
+
+        packets++;
+    }
+
+    return packets * 1e9 / timer.nsecsElapsed();
+}
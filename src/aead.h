@@ -0,0 +1,34 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+
+constexpr const char *DEFAULT_AEAD = "XChaCha20Poly1305";
+
+class Aead
+{
+public:
+    virtual ~Aead();
+
+    static void prepare();
+
+    static Aead *create(const QByteArray &);
+    static const QList<QByteArray> &getOffered();
+    static bool isOffered(const QByteArray &);
+
+    virtual int tagSize() const = 0;
+    virtual int nonceSize() const = 0;
+
+    virtual void setKey(const QVector<quint8> &) = 0;
+    virtual void seal(quint8 *, const quint8 *, int, quint8 *, const quint8 *) = 0;
+    virtual bool open(quint8 *, const quint8 *, int, const quint8 *, const quint8 *) = 0;
+
+private:
+    static QList<QByteArray> offered;
+
+    static double measure(const QByteArray &);
+};
+
+#endif // AEAD_H
@@ -0,0 +1,397 @@
+#include "archive.h"
+#include "database.h"
+#include "server.h"
+#include "stats.h"
+
+#include <QtDebug>
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QSet>
+#include <QSqlError>
+#include <QStringList>
+
+#include <algorithm>
+
+static constexpr int MAX_BATCH = 10000;
+static constexpr int BENCHMARK_MS = 2000;
+static constexpr int BENCHMARK_DRAIN_MS = 10000;
+static constexpr int BENCHMARK_PRODUCERS = 4;
+static constexpr int BENCHMARK_RATE = 20000;
+
+QThread *Archive::thread = nullptr;
+QObject *Archive::context = nullptr;
+QTimer *Archive::timer = nullptr;
+QMutex Archive::mutex;
+QVector<Archive::Pending> Archive::pending;
+QHash<int, QSharedPointer<QSqlQuery>> Archive::statements;
+int Archive::batch = 1;
+int Archive::window = 0;
+bool Archive::writeBehind = false;
+QString Archive::table = "ARCHIVE";
+
+void Archive::prepare()
+{
+    auto &settings = Server::getSettings();
+
+    batch = qBound(1, settings.value("ArchiveBatch", 256).toInt(), MAX_BATCH);
+    window = qMax(settings.value("ArchiveWindow", 5).toInt(), 0);
+    writeBehind = settings.value("ArchiveWriteBehind", false).toBool();
+
+    start();
+
+    QObject::connect(qApp, &QCoreApplication::aboutToQuit, &Archive::stop);
+}
+
+void Archive::benchmark()
+{
+    auto &settings = Server::getSettings();
+
+    auto db = QSqlDatabase::addDatabase("QPSQL");
+    db.setDatabaseName(settings.value("DbName").toString());
+    db.setHostName(settings.value("DbHost").toString());
+    db.setPort(settings.value("DbPort").toInt());
+    db.setUserName(settings.value("DbUser").toString());
+    db.setPassword(settings.value("DbPass").toString());
+
+    if (!db.open())
+    {
+        qWarning().noquote() << "Archive benchmark skipped, could not open database";
+        return;
+    }
+
+    QSqlQuery query(db);
+
+    if (!query.exec("CREATE TABLE IF NOT EXISTS ARCHIVE_BENCHMARK"
+                    "("
+                    "ID         SERIAL PRIMARY KEY,"
+                    "TIMESTAMP  BIGINT NOT NULL,"
+                    "ID_MESSAGE BYTEA  NOT NULL UNIQUE,"
+                    "ID_ROOM    BYTEA  NOT NULL,"
+                    "ID_SENDER  TEXT   NOT NULL,"
+                    "CONTENT    TEXT   NOT NULL"
+                    ")"))
+    {
+        qWarning().noquote() << query.lastError().text();
+        return;
+    }
+
+    struct Run
+    {
+        QElapsedTimer clock;
+        QVector<qint64> latencies;
+        QAtomicInteger<qint64> submitted;
+        QAtomicInteger<qint64> completed;
+    };
+
+    table = "ARCHIVE_BENCHMARK";
+    batch = qBound(1, settings.value("ArchiveBatch", 256).toInt(), MAX_BATCH);
+
+    start();
+
+    QThread collector;
+    QObject receiver;
+
+    receiver.moveToThread(&collector);
+    collector.start();
+
+    QAtomicInteger<quint64> sequence(0);
+
+    for (auto span : { 0, 1, 5, 20 })
+    {
+        window = span;
+
+        if (!query.exec("TRUNCATE ARCHIVE_BENCHMARK"))
+        {
+            qWarning().noquote() << query.lastError().text();
+            break;
+        }
+
+        auto run = QSharedPointer<Run>::create();
+        auto inserts = Stats::value("archive.inserts");
+
+        QVector<QThread *> producers;
+
+        run->clock.start();
+
+        for (int p = 0; p < BENCHMARK_PRODUCERS; p++)
+        {
+            producers.append(QThread::create([ =, &receiver, &sequence]
+            {
+                auto interval = qint64(1000000000) * BENCHMARK_PRODUCERS / BENCHMARK_RATE;
+
+                for (qint64 i = 0;; i++)
+                {
+                    auto due = i * interval + p * interval / BENCHMARK_PRODUCERS;
+
+                    if (due >= qint64(BENCHMARK_MS) * 1000000)
+                    {
+                        break;
+                    }
+
+                    auto ahead = due - run->clock.nsecsElapsed();
+
+                    if (ahead > 1000)
+                    {
+                        QThread::usleep(quint64(ahead / 1000));
+                    }
+
+                    auto stamp = run->clock.nsecsElapsed();
+
+                    run->submitted++;
+
+                    submit(&receiver, Entry
+                    {
+                        QDateTime::currentSecsSinceEpoch(),
+                        QByteArray::number(++sequence),
+                        "benchmark",
+                        "benchmark",
+                        QString(64, 'x')
+                    }, [ = ](bool)
+                    {
+                        run->latencies.append(run->clock.nsecsElapsed() - stamp);
+                        run->completed++;
+                    });
+                }
+            }));
+        }
+
+        for (auto producer : producers)
+        {
+            producer->start();
+        }
+
+        for (auto producer : producers)
+        {
+            producer->wait();
+            delete producer;
+        }
+
+        QElapsedTimer drain;
+        drain.start();
+
+        while (run->completed.load() < run->submitted.load() && drain.elapsed() < BENCHMARK_DRAIN_MS)
+        {
+            QThread::msleep(1);
+        }
+
+        auto elapsed = run->clock.nsecsElapsed();
+
+        QVector<qint64> samples;
+
+        QMetaObject::invokeMethod(&receiver, [ =, &samples]
+        {
+            samples = run->latencies;
+        }, Qt::BlockingQueuedConnection);
+
+        std::sort(samples.begin(), samples.end());
+
+        auto count = samples.size();
+        auto flushes = Stats::value("archive.inserts") - inserts;
+        qint64 sum = 0;
+
+        for (auto sample : samples)
+        {
+            sum += sample;
+        }
+
+        qInfo().noquote() << QString("Archive window %1 ms: %2 of %3 messages committed at %4 messages/s,"
+                                     " commit latency mean %5 us, p50 %6 us, p99 %7 us, %8 messages per insert")
+                          .arg(span)
+                          .arg(count)
+                          .arg(run->submitted.load())
+                          .arg(count * 1e9 / elapsed, 0, 'f', 0)
+                          .arg(count > 0 ? sum / count / 1000 : 0)
+                          .arg(count > 0 ? samples.at(count / 2) / 1000 : 0)
+                          .arg(count > 0 ? samples.at(qMin(count - 1, count * 99 / 100)) / 1000 : 0)
+                          .arg(flushes > 0 ? double(count) / flushes : 0, 0, 'f', 1);
+    }
+
+    stop();
+
+    collector.quit();
+    collector.wait();
+
+    query.exec("DROP TABLE ARCHIVE_BENCHMARK");
+    query.clear();
+    db.close();
+}
+
+void Archive::start()
+{
+    thread = new QThread;
+    context = new QObject;
+
+    timer = new QTimer(context);
+    timer->setSingleShot(true);
+    timer->callOnTimeout(&Archive::flush);
+
+    context->moveToThread(thread);
+    thread->start();
+}
+
+void Archive::stop()
+{
+    QMetaObject::invokeMethod(context, &Archive::flush, Qt::BlockingQueuedConnection);
+
+    thread->quit();
+    thread->wait();
+}
+
+bool Archive::isWriteBehind()
+{
+    return writeBehind;
+}
+
+void Archive::submit(QObject *receiver, const Entry &entry, std::function<void(bool)> done)
+{
+    mutex.lock();
+
+    pending.append(Pending
+    {
+        entry,
+        receiver,
+        done
+    });
+
+    auto size = pending.size();
+
+    mutex.unlock();
+
+    Stats::record("archive.pending", size);
+
+    if (size >= batch || window == 0)
+    {
+        QMetaObject::invokeMethod(context, &Archive::flush, Qt::QueuedConnection);
+    }
+    else if (size == 1)
+    {
+        QMetaObject::invokeMethod(context, [ = ]
+        {
+            if (!timer->isActive())
+            {
+                timer->start(window);
+            }
+        }, Qt::QueuedConnection);
+    }
+}
+
+void Archive::flush()
+{
+    timer->stop();
+
+    mutex.lock();
+
+    QVector<Pending> jobs;
+    jobs.swap(pending);
+
+    mutex.unlock();
+
+    while (!jobs.isEmpty())
+    {
+        auto count = qMin(jobs.size(), batch);
+
+        QVector<Entry> entries;
+        entries.reserve(count);
+
+        for (int i = 0; i < count; i++)
+        {
+            entries.append(jobs.at(i).entry);
+        }
+
+        auto &query = statements[count];
+
+        if (query.isNull())
+        {
+            query = QSharedPointer<QSqlQuery>::create(Database::get());
+
+            if (!query->prepare(statement(table, count)))
+            {
+                Server::error(query->lastError().text());
+            }
+        }
+
+        QElapsedTimer elapsed;
+        elapsed.start();
+
+        auto stored = insert(*query, entries);
+
+        Stats::add("archive.inserts");
+        Stats::record("archive.batch", count);
+        Stats::record("archive.flush_us", elapsed.nsecsElapsed() / 1000);
+
+        for (int i = 0; i < count; i++)
+        {
+            auto job = jobs.at(i);
+            auto ok = stored.at(i);
+
+            if (!ok)
+            {
+                Stats::add("archive.duplicates");
+            }
+
+            QMetaObject::invokeMethod(job.context, [ = ]
+            {
+                job.done(ok);
+            }, Qt::QueuedConnection);
+        }
+
+        jobs.remove(0, count);
+    }
+}
+
+QString Archive::statement(const QString &table, int rows)
+{
+    QStringList values;
+
+    for (int i = 0; i < rows; i++)
+    {
+        values << "(?, ?, ?, ?, ?)";
+    }
+
+    return QString("INSERT INTO %1 (TIMESTAMP, ID_MESSAGE, ID_ROOM, ID_SENDER, CONTENT)"
+                   " VALUES %2"
+                   " ON CONFLICT (ID_MESSAGE) DO NOTHING"
+                   " RETURNING ID_MESSAGE")
+           .arg(table)
+           .arg(values.join(", "));
+}
+
+QVector<bool> Archive::insert(QSqlQuery &query, const QVector<Entry> &entries)
+{
+    int index = 0;
+
+    for (const auto &entry : entries)
+    {
+        query.bindValue(index++, entry.timestamp);
+        query.bindValue(index++, entry.id);
+        query.bindValue(index++, entry.id_room);
+        query.bindValue(index++, entry.id_sender);
+        query.bindValue(index++, entry.content);
+    }
+
+    if (!query.exec())
+    {
+        Server::error(query.lastError().text());
+    }
+
+    QSet<QByteArray> inserted;
+
+    while (query.next())
+    {
+        inserted.insert(query.value(0).toByteArray());
+    }
+
+    query.finish();
+
+    QVector<bool> stored;
+    stored.reserve(entries.size());
+
+    for (const auto &entry : entries)
+    {
+        stored.append(inserted.remove(entry.id));
+    }
+
+    return stored;
+}
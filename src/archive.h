@@ -0,0 +1,62 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QThread>
+#include <QTimer>
+#include <QVector>
+
+#include <functional>
+
+class Archive
+{
+public:
+    struct Entry
+    {
+        qint64 timestamp;
+        QByteArray id;
+        QByteArray id_room;
+        QString id_sender;
+        QString content;
+    };
+
+    static void prepare();
+    static void benchmark();
+
+    static bool isWriteBehind();
+
+    static void submit(QObject *, const Entry &, std::function<void(bool)>);
+
+private:
+    struct Pending
+    {
+        Entry entry;
+        QObject *context;
+        std::function<void(bool)> done;
+    };
+
+    static QThread *thread;
+    static QObject *context;
+    static QTimer *timer;
+
+    static QMutex mutex;
+    static QVector<Pending> pending;
+    static QHash<int, QSharedPointer<QSqlQuery>> statements;
+
+    static int batch;
+    static int window;
+    static bool writeBehind;
+    static QString table;
+
+    static void start();
+    static void stop();
+    static void flush();
+    static QString statement(const QString &, int);
+    static QVector<bool> insert(QSqlQuery &, const QVector<Entry> &);
+};
+
+#endif // ARCHIVE_H
@@ -0,0 +1,37 @@
+#include "auth.h"
+#include "server.h"
+
+#include <cryptopp/pwdbased.h>
+#include <cryptopp/sha3.h>
+using CryptoPP::PKCS5_PBKDF2_HMAC;
+using CryptoPP::SHA3_512;
+
+Executor Auth::executor("auth");
+
+void Auth::prepare()
+{
+    auto &settings = Server::getSettings();
+
+    executor.prepare(settings.value("AuthThreads", 2).toInt(),
+                     settings.value("AuthQueue", 64).toInt());
+}
+
+Executor &Auth::getExecutor()
+{
+    return executor;
+}
+
+QByteArray Auth::derive(const QByteArray &password, const QByteArray &salt)
+{
+    QByteArray derived;
+    derived.resize(64);
+
+    PKCS5_PBKDF2_HMAC<SHA3_512> pbkdf;
+    pbkdf.DeriveKey(reinterpret_cast<quint8 *>(derived.data()), derived.size(),
+                    0,
+                    reinterpret_cast<const quint8 *>(password.constData()), password.size(),
+                    reinterpret_cast<const quint8 *>(salt.constData()), salt.size(),
+                    100000);
+
+    return derived;
+}
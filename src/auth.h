@@ -0,0 +1,19 @@
+#ifndef AUTH_H
+#define AUTH_H
+
+#include "executor.h"
+
+class Auth
+{
+public:
+    static void prepare();
+
+    static Executor &getExecutor();
+
+    static QByteArray derive(const QByteArray &, const QByteArray &);
+
+private:
+    static Executor executor;
+};
+
+#endif // AUTH_H
@@ -1,38 +1,158 @@
 #include "client.h"
+#include "aead.h"
+#include "archive.h"
+#include "auth.h"
+#include "crypto.h"
 #include "database.h"
+#include "delivery.h"
 #include "file.h"
+#include "groups.h"
+#include "keypool.h"
 #include "server.h"
+#include "sessions.h"
+#include "stats.h"
+#include "thread.h"
+#include "tickets.h"
 
 #include <QDateTime>
 #include <QDir>
 #include <QHostAddress>
-#include <QSqlError>
-#include <QSqlQuery>
+#include <QThreadStorage>
+#include <QtAlgorithms>
+#include <QtEndian>
+#include <QtMath>
+
+#include <cryptopp/misc.h>
+using CryptoPP::VerifyBufsEqual;
+
+#ifdef Q_OS_UNIX
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#endif
+
+static constexpr int HEADER_SIZE = 3;
+static constexpr int EXTENDED_HEADER_SIZE = 6;
+static constexpr int MAX_IV = 32;
+static constexpr qint64 TRANSFER_CHUNK = 32768;
+static constexpr int MAX_IOV = 64;
+static constexpr int RESUMPTION_NONCE = 16;
+static constexpr qint64 READ_CHUNK = 0x10000;
+static constexpr int POOL_SIZE = 256;
+static constexpr int POOL_CAPACITY = 0x10000 + 64;
+
+static QThreadStorage<QVector<QByteArray>> buffers;
+
+static QByteArray acquireBuffer()
+{
+    auto &pool = buffers.localData();
+
+    if (pool.isEmpty())
+    {
+        Stats::add("frames.allocated");
+
+        QByteArray buffer;
+        buffer.reserve(1024);
 
-#include <cryptopp/pwdbased.h>
-#include <cryptopp/sha3.h>
-using CryptoPP::PKCS5_PBKDF2_HMAC;
-using CryptoPP::SHA3_512;
+        return buffer;
+    }
 
-#ifdef __cplusplus
-extern "C" {
-#include <oqs/oqs.h>
+    return pool.takeLast();
 }
-#endif
+
+static void releaseBuffer(QByteArray &buffer)
+{
+    auto &pool = buffers.localData();
+
+    if (!buffer.isDetached()
+            || buffer.capacity() > POOL_CAPACITY
+            || pool.size() >= POOL_SIZE)
+    {
+        return;
+    }
+
+    buffer.resize(0);
+    pool.append(std::move(buffer));
+}
+
+constexpr Client::Route Client::routes[] =
+{
+    { PacketType::Handshake, false, &Client::decode<ClientKeyExchange, &Client::doHandshake> },
+    { PacketType::RtAuthorization, true, &Client::decode<RtAuthorization, &Client::doRtAuthorization> },
+    { PacketType::ReAuthorization, true, nullptr },
+    { PacketType::Established, true, nullptr },
+    { PacketType::Synchronize, true, &Client::decodeView<SynchronizeView, &Client::doSynchronize> },
+    { PacketType::UserState, true, nullptr },
+    { PacketType::Message, true, &Client::decodeView<MessageView, &Client::doMessage> },
+    { PacketType::RtRoom, true, &Client::decode<RtRoom, &Client::doRtRoom> },
+    { PacketType::ReRoom, true, nullptr },
+    { PacketType::RtUpload, true, &Client::decode<RtUpload, &Client::doRtUpload> },
+    { PacketType::ReUpload, true, nullptr },
+    { PacketType::Upload, true, &Client::decodeView<UploadView, &Client::doUpload> },
+    { PacketType::UploadState, true, &Client::decode<UploadState, &Client::doUploadState> },
+    { PacketType::Ping, true, nullptr },
+    { PacketType::Pong, true, &Client::decodeView<Ping, &Client::doPong> },
+    { PacketType::SessionTicket, false, nullptr },
+    { PacketType::Resumption, false, &Client::decode<Resumption, &Client::doResumption> },
+    { PacketType::ReResumption, false, nullptr },
+    { PacketType::SessionToken, true, nullptr },
+    { PacketType::GroupKey, true, nullptr },
+    { PacketType::GroupMessage, true, nullptr }
+};
+
+constexpr int Client::routeCount;
+
+static void counterNonce(quint8 *nonce, int size, quint64 sequence)
+{
+    memset(nonce, 0, size_t(size));
+
+    for (int i = qMin(8, size) - 1; i >= 0; i--)
+    {
+        nonce[i] = quint8(sequence);
+        sequence >>= 8;
+    }
+}
+
+bool Client::noDelay = true;
+int Client::maxFrameSize = 1 << 20;
+quint64 Client::rekeyPackets = 1 << 24;
+quint64 Client::rekeyBytes = Q_UINT64_C(1) << 36;
+int Client::resumptionWindow = 50;
 
 Client::Client()
-    : interruptionRequested(false)
+    : socket(nullptr)
+    , group(false)
+    , interruptionRequested(false)
     , reading(false)
+    , suspended(false)
     , writing(false)
+    , archiving(0)
     , encryption(false)
-    , public_key(OQS_KEM_sike_p751_length_public_key)
-    , secret_key(OQS_KEM_sike_p751_length_secret_key)
-    , shared_secret(OQS_KEM_sike_p751_length_shared_secret)
+    , traffic(0)
+    , migration(nullptr)
+    , flushPending(false)
+    , resumptionTimer(nullptr)
+    , version(0)
 {
 }
 
+void Client::prepare()
+{
+    static_assert(isRouted(0), "Packet routing table does not match the packet types");
+
+    auto &settings = Server::getSettings();
+
+    noDelay = settings.value("TcpNoDelay", true).toBool();
+    maxFrameSize = qMax(settings.value("MaxFrameSize", 1 << 20).toInt(), 0xFFFF);
+    rekeyPackets = settings.value("RekeyPackets", rekeyPackets).toULongLong();
+    rekeyBytes = settings.value("RekeyBytes", rekeyBytes).toULongLong();
+    resumptionWindow = settings.value("ResumptionWindow", resumptionWindow).toInt();
+}
+
 Client::~Client()
 {
+    Delivery::detach(this);
+
     socket->disconnect();
     socket->deleteLater();
 
@@ -44,10 +164,67 @@ Client::~Client()
     Server::connected.remove(id, this);
 }
 
+qint64 Client::takeTraffic()
+{
+    auto value = traffic;
+    traffic = 0;
+    return value;
+}
+
+bool Client::isPinned() const
+{
+    return Thread::hasRoomAffinity() && !id_room.isEmpty();
+}
+
+bool Client::isMigratable() const
+{
+    return socket != nullptr
+           && !interruptionRequested
+           && !suspended
+           && !writing;
+}
+
+bool Client::migrate(QThread *target)
+{
+    if (target == thread() || !isMigratable())
+    {
+        return false;
+    }
+
+    if (reading)
+    {
+        migration = target;
+        return true;
+    }
+
+    flush();
+
+    auto source = thread();
+
+    for (const auto &file : usershare)
+    {
+        file->moveToThread(target);
+    }
+
+    socket->moveToThread(target);
+    moveToThread(target);
+
+    Thread::migrate(this, source);
+
+    Delivery::attach(this, target);
+
+    QMetaObject::invokeMethod(this, "onReadyRead", Qt::QueuedConnection);
+
+    return true;
+}
+
 void Client::run(QTcpSocket *socket)
 {
     this->socket = socket;
-    stream.setDevice(socket);
+
+    socket->setSocketOption(QAbstractSocket::LowDelayOption, noDelay ? 1 : 0);
+
+    Delivery::attach(this, thread());
 
     connect(socket, &QTcpSocket::disconnected,
             this, &Client::onDisconnected);
@@ -66,54 +243,65 @@ void Client::run(QTcpSocket *socket)
     {
         pingTimestamp = QDateTime::currentSecsSinceEpoch();
 
-        sendOne(PacketType::Ping, QVariant::fromValue(
-        Ping {
+        send(PacketType::Ping, Ping {
             pingTimestamp
-        }));
+        });
 
         disconnectTimer->start();
     });
     pingTimer->setInterval(30000);
 
-    OQS_STATUS rc;
+    handshakeTimer.start();
 
-    rc = OQS_KEM_sike_p751_keypair(public_key.data(),
-                                   secret_key.data());
-
-    if (rc != OQS_SUCCESS)
+    if (resumptionWindow > 0 && Tickets::isExpected(socket->peerAddress()))
     {
-        close("Failed to generate ephemeral key pair");
+        resumptionTimer = new QTimer(this);
+        resumptionTimer->setSingleShot(true);
+        resumptionTimer->callOnTimeout(this, &Client::beginHandshake);
+        resumptionTimer->start(resumptionWindow);
         return;
     }
 
-    QVector<quint8> signature(OQS_SIG_picnic2_L5_FS_length_signature);
-    size_t signature_len;
+    beginHandshake();
+}
+
+void Client::beginHandshake()
+{
+    if (resumptionTimer != nullptr)
+    {
+        resumptionTimer->stop();
+        resumptionTimer->deleteLater();
+        resumptionTimer = nullptr;
+    }
 
-    rc = OQS_SIG_picnic2_L5_FS_sign(signature.data(),
-                                    &signature_len,
-                                    public_key.constData(),
-                                    public_key.size(),
-                                    Server::getSecretKey().constData());
+    EphemeralKey precomputed;
 
-    if (rc != OQS_SUCCESS)
+    if (KeyPool::take(precomputed))
     {
-        close("Failed to sign ephemeral public key");
+        startHandshake(precomputed);
         return;
     }
 
-    signature.resize(signature_len);
+    auto key = QSharedPointer<EphemeralKey>::create();
 
-    sendOne(PacketType::Handshake, QVariant::fromValue(
-                ServerKeyExchange
+    auto accepted = dispatch(Crypto::getExecutor(), [ = ]
     {
+        *key = Crypto::generate();
+    }, [ = ]
+    {
+        if (key->signature.isEmpty())
         {
-            Server::getPublicKey(),
-            public_key
-        },
-        signature
-    }));
+            close("Failed to generate ephemeral key pair");
+            return;
+        }
 
-    pingTimer->start();
+        startHandshake(*key);
+    });
+
+    if (!accepted)
+    {
+        close("Crypto executor queue is full");
+    }
 }
 
 void Client::close(QString reason)
@@ -129,6 +317,7 @@ void Client::close(QString reason)
                               .arg(reason);
     }
 
+    flush();
     socket->close();
 }
 
@@ -136,7 +325,17 @@ void Client::onDisconnected()
 {
     interruptionRequested = true;
 
-    if (reading)
+    if (archiving > 0)
+    {
+        connect(this, &Client::archived,
+                this, &Client::onDisconnected, Qt::UniqueConnection);
+    }
+    else if (suspended)
+    {
+        connect(this, &Client::resumed,
+                this, &Client::deleteLater);
+    }
+    else if (reading)
     {
         connect(this, &Client::read,
                 this, &Client::deleteLater);
@@ -154,335 +353,561 @@ void Client::onDisconnected()
 
 void Client::onReadyRead()
 {
-    if (interruptionRequested)
+    if (interruptionRequested || suspended)
     {
         return;
     }
 
     reading = true;
 
-    while (!socket->atEnd())
-    {
-        stream.startTransaction();
-
-        quint8 type;
-        quint16 length;
-        stream >> type >> length;
+    Parser::Frame frame;
 
-        QByteArray in;
-        QVector<quint8> crypto[2];
-
-        if (length > 0)
+    while (!suspended)
+    {
+        if (!parser.next(frame, framing()))
         {
-            in.resize(length);
-
-            if (encryption)
+            if (parser.hasError())
             {
-                crypto[0].resize(dec.DigestSize());
-                crypto[1].resize(dec.DefaultIVLength());
+                close("Client sent a malformed or oversized frame");
+                break;
+            }
 
-                stream.readRawData(reinterpret_cast<char *>(crypto[0].data()), crypto[0].size());
-                stream.readRawData(reinterpret_cast<char *>(crypto[1].data()), crypto[1].size());
+            auto available = qMin(socket->bytesAvailable(), READ_CHUNK);
+
+            if (available <= 0 || parser.fill(socket, available) <= 0)
+            {
+                break;
             }
 
-            stream.readRawData(in.data(), in.size());
+            continue;
         }
 
-        if (!stream.commitTransaction())
+        Thread::account(frame.size);
+        traffic += frame.size;
+
+        if (frame.crypto != nullptr && !open(frame))
         {
+            close("Failed to decrypt incoming packet");
             break;
         }
 
-        QVariant v;
-
-        if (length > 0)
+        if (frame.type >= routeCount)
         {
-            if (encryption)
-            {
-                dec.SetKeyWithIV(shared_secret.constData(),
-                                 shared_secret.size(),
-                                 crypto[1].constData(),
-                                 crypto[1].size());
-
-                if (!dec.DecryptAndVerify(reinterpret_cast<quint8 *>(in.data()),
-                                          crypto[0].constData(),
-                                          crypto[0].size(),
-                                          crypto[1].constData(),
-                                          crypto[1].size(),
-                                          nullptr,
-                                          0,
-                                          reinterpret_cast<const quint8 *>(in.constData()), in.size()))
-                {
-                    close("Failed to decrypt incoming packet");
-                    break;
-                }
-            }
-
-            QDataStream ds(&in, QIODevice::ReadOnly);
-            v.load(ds);
+            continue;
         }
 
-        bool ok = true;
+        const auto &route = routes[frame.type];
 
-        if (!encryption)
+        if (route.decode == nullptr || route.encrypted != encryption)
         {
-            switch (type)
-            {
-            case quint8(PacketType::Handshake):
-            {
-                if ((ok = v.canConvert<ClientKeyExchange>()))
-                {
-                    doHandshake(v.value<ClientKeyExchange>());
-                }
-            }
-            break;
-            }
+            continue;
         }
-        else
+
+        if (!route.decode(this, frame.payload, frame.length))
         {
-            switch (type)
-            {
-            case quint8(PacketType::RtAuthorization):
-            {
-                if ((ok = v.canConvert<RtAuthorization>()))
-                {
-                    doRtAuthorization(v.value<RtAuthorization>());
-                }
-            }
+            close("Failed to deserialize incoming packet");
             break;
+        }
+    }
 
-            case quint8(PacketType::Synchronize):
-            {
-                if ((ok = v.canConvert<Synchronize>()))
-                {
-                    doSynchronize(v.value<Synchronize>());
-                }
-            }
-            break;
+    reading = false;
+    emit read();
 
-            case quint8(PacketType::Message):
-            {
-                if ((ok = v.canConvert<Message>()))
-                {
-                    doMessage(v.value<Message>());
-                }
-            }
-            break;
+    if (migration != nullptr && isMigratable())
+    {
+        auto target = migration;
+        migration = nullptr;
 
-            case quint8(PacketType::RtRoom):
-            {
-                if ((ok = v.canConvert<RtRoom>()))
-                {
-                    doRtRoom(v.value<RtRoom>());
-                }
-            }
-            break;
+        migrate(target);
+    }
+}
 
-            case quint8(PacketType::RtUpload):
-            {
-                if ((ok = v.canConvert<RtUpload>()))
-                {
-                    doRtUpload(v.value<RtUpload>());
-                }
-            }
-            break;
+bool Client::dispatch(Executor &executor, std::function<void()> job, std::function<void()> done)
+{
+    auto accepted = executor.submit(this, job, [ = ]
+    {
+        resume(done);
+    });
 
-            case quint8(PacketType::Upload):
-            {
-                if ((ok = v.canConvert<Upload>()))
-                {
-                    doUpload(v.value<Upload>());
-                }
-            }
-            break;
+    if (accepted)
+    {
+        suspended = true;
+    }
 
-            case quint8(PacketType::UploadState):
-            {
-                if ((ok = v.canConvert<UploadState>()))
-                {
-                    doUploadState(v.value<UploadState>());
-                }
-            }
-            break;
+    return accepted;
+}
 
-            case quint8(PacketType::Pong):
-            {
-                if ((ok = v.canConvert<Ping>()))
-                {
-                    doPong(v.value<Ping>());
-                }
-            }
-            break;
-            }
-        }
+void Client::resume(std::function<void()> done)
+{
+    suspended = false;
 
-        if (!ok)
-        {
-            close("Failed to deserialize incoming packet");
-            break;
-        }
+    if (!interruptionRequested)
+    {
+        done();
     }
 
-    reading = false;
-    emit read();
+    emit resumed();
+
+    if (!interruptionRequested && !suspended)
+    {
+        onReadyRead();
+    }
+}
+
+void Client::startHandshake(const EphemeralKey &key)
+{
+    public_key = key.public_key;
+    secret_key = key.secret_key;
+
+    send(PacketType::Handshake, ServerKeyExchange
+    {
+        {
+            Server::getPublicKey(),
+            public_key
+        },
+        key.signature,
+        Crypto::getKem()->method_name,
+        Crypto::getSig()->method_name,
+        PROTOCOL_VERSION,
+        rekeyPackets,
+        rekeyBytes,
+        Aead::getOffered()
+    });
+
+    pingTimer->start();
 }
 
 void Client::doHandshake(ClientKeyExchange d)
 {
-    auto rc = OQS_KEM_sike_p751_decaps(shared_secret.data(),
-                                       d.ciphertext.constData(),
-                                       secret_key.constData());
+    version = qMin(d.version, PROTOCOL_VERSION);
+    aead = hasAeadChoice(version) ? d.aead : QByteArray(DEFAULT_AEAD);
 
-    if (rc != OQS_SUCCESS)
+    if (hasAeadChoice(version) && !Aead::isOffered(aead))
     {
-        close(tr("Failed to reach shared secret"));
+        close("Client chose an unsupported cipher");
         return;
     }
 
-    encryption = true;
+    Stats::add("protocol.version." + QByteArray::number(version));
 
-    public_key.clear();
-    secret_key.clear();
+    auto secret = QSharedPointer<QVector<quint8>>::create();
+    auto key = secret_key;
+
+    auto accepted = dispatch(Crypto::getExecutor(), [ = ]
+    {
+        QElapsedTimer timer;
+        timer.start();
+
+        *secret = Crypto::decapsulate(d.ciphertext, key);
+
+        Stats::record("crypto.decaps_us", timer.nsecsElapsed() / 1000);
+    }, [ = ]
+    {
+        if (secret->isEmpty())
+        {
+            close("Failed to reach shared secret");
+            return;
+        }
+
+        shared_secret = *secret;
+        startEncryption();
+
+        public_key.clear();
+        secret_key.clear();
+
+        Stats::record("handshake.latency_us", handshakeTimer.nsecsElapsed() / 1000);
+
+        issueTicket();
+    });
+
+    if (!accepted)
+    {
+        close("Crypto executor queue is full");
+    }
 }
 
-void DeriveKey(QByteArray &derived, const QByteArray &password, const QByteArray &salt)
+void Client::doResumption(Resumption d)
 {
-    PKCS5_PBKDF2_HMAC<SHA3_512> pbkdf;
-    pbkdf.DeriveKey(reinterpret_cast<quint8 *>(derived.data()), derived.size(),
-                    0,
-                    reinterpret_cast<const quint8 *>(password.constData()), password.size(),
-                    reinterpret_cast<const quint8 *>(salt.constData()), salt.size(),
-                    100000);
+    auto early = resumptionTimer != nullptr;
+    auto secret = Tickets::redeem(d.ticket);
+    auto cipher = hasAeadChoice(d.version) ? d.aead : QByteArray(DEFAULT_AEAD);
+
+    if (secret.isEmpty() || d.nonce.size() < 16
+            || (hasAeadChoice(d.version) && !Aead::isOffered(cipher)))
+    {
+        Stats::add("resumption.misses");
+
+        send(PacketType::ReResumption, ReResumption
+        {
+            ReResumption::Rejected,
+            {}
+        });
+
+        if (early)
+        {
+            beginHandshake();
+        }
+        return;
+    }
+
+    if (early)
+    {
+        resumptionTimer->stop();
+        resumptionTimer->deleteLater();
+        resumptionTimer = nullptr;
+
+        pingTimer->start();
+    }
+
+    QByteArray info("neutron resumption");
+    info.append(reinterpret_cast<const char *>(public_key.constData()), public_key.size());
+
+    QByteArray salt(d.nonce);
+    QByteArray nonce;
+
+    if (early)
+    {
+        nonce.resize(RESUMPTION_NONCE);
+        rng.GenerateBlock(reinterpret_cast<quint8 *>(nonce.data()), nonce.size());
+
+        salt.append(nonce);
+    }
+
+    send(PacketType::ReResumption, ReResumption
+    {
+        ReResumption::Resumed,
+        nonce
+    });
+
+    version = qMin(d.version, PROTOCOL_VERSION);
+    aead = cipher;
+
+    Stats::add("protocol.version." + QByteArray::number(version));
+
+    shared_secret = Crypto::derive(secret, info, salt);
+    startEncryption();
+
+    public_key.clear();
+    secret_key.clear();
+
+    Stats::add("resumption.hits");
+    Stats::add("resumption.saved_us", Stats::mean("crypto.generate_us") + Stats::mean("crypto.decaps_us"));
+    Stats::record("handshake.latency_us", handshakeTimer.nsecsElapsed() / 1000);
+
+    issueTicket();
 }
 
-void Client::doRtAuthorization(RtAuthorization d)
+void Client::issueTicket()
 {
-    QSqlQuery query(Database::get());
-    query.prepare("SELECT DERIVED, SALT FROM USERS"
-                  " WHERE USERNAME = ?");
-    query.addBindValue(d.username);
+    auto ticket = Tickets::issue(Crypto::derive(shared_secret, "neutron ticket"));
 
-    if (!query.exec())
+    if (ticket.isEmpty())
     {
-        Server::error(query.lastError().text());
+        return;
     }
 
-    if (query.next())
+    Tickets::remember(socket->peerAddress());
+
+    send(PacketType::SessionTicket, SessionTicket
     {
-        switch (d.request)
-        {
-        case RtAuthorization::Signin:
+        ticket,
+        Tickets::getLifetime()
+    });
+}
+
+void Client::doRtAuthorization(RtAuthorization d)
+{
+    switch (d.request)
+    {
+    case RtAuthorization::Token:
+    {
+        auto valid = QSharedPointer<bool>::create(false);
+
+        execute([ = ]
         {
-            QByteArray derived;
-            derived.resize(64);
+            QElapsedTimer timer;
+            timer.start();
 
-            DeriveKey(derived, d.password, query.value(1).toByteArray());
+            *valid = Sessions::verify(d.username, d.password);
 
-            if (derived != query.value(0).toByteArray())
+            Stats::record("auth.token_us", timer.nsecsElapsed() / 1000);
+        }, [ = ]
+        {
+            if (!*valid)
             {
-                sendOne(PacketType::ReAuthorization, QVariant::fromValue(
-                            ReAuthorization
+                send(PacketType::ReAuthorization, ReAuthorization
                 {
                     ReAuthorization::ErrorOccurred,
-                    ReAuthorization::InvalidPassword
-                }));
+                    ReAuthorization::InvalidToken
+                });
                 return;
             }
+
+            authorize(d.username, false);
+        });
+    }
+    return;
+
+    case RtAuthorization::Revoke:
+    {
+        if (id != d.username)
+        {
+            close("Client wants to revoke a session token without being authorized");
+            return;
         }
-        break;
 
-        case RtAuthorization::Signup:
+        execute([ = ]
         {
-            sendOne(PacketType::ReAuthorization, QVariant::fromValue(
-                        ReAuthorization
+            if (Sessions::verify(d.username, d.password))
             {
-                ReAuthorization::ErrorOccurred,
-                ReAuthorization::UserExists
-            }));
-        }
+                Sessions::revoke(d.password);
+            }
+        }, [] {});
+    }
+    return;
 
-        return;
-        }
+    default:
+        break;
     }
-    else
+
+    execute("SELECT DERIVED, SALT FROM USERS"
+            " WHERE USERNAME = ?",
+    {
+        d.username
+    }, [ = ](const Database::Result &result)
     {
-        switch (d.request)
+        if (!result.ok)
         {
-        case RtAuthorization::Signin:
+            Server::error(result.error);
+        }
+
+        if (!result.rows.isEmpty())
         {
-            sendOne(PacketType::ReAuthorization, QVariant::fromValue(
-                        ReAuthorization
+            switch (d.request)
             {
-                ReAuthorization::ErrorOccurred,
-                ReAuthorization::InvalidUsername
-            }));
-        }
+            case RtAuthorization::Signin:
+            {
+                auto expected = result.rows.first().at(0).toByteArray();
+                auto salt = result.rows.first().at(1).toByteArray();
+                auto derived = QSharedPointer<QByteArray>::create();
 
-        return;
+                derive([ = ]
+                {
+                    *derived = Auth::derive(d.password, salt);
+                }, [ = ]
+                {
+                    if (derived->size() != expected.size()
+                            || !VerifyBufsEqual(reinterpret_cast<const quint8 *>(derived->constData()),
+                                                reinterpret_cast<const quint8 *>(expected.constData()),
+                                                expected.size()))
+                    {
+                        send(PacketType::ReAuthorization, ReAuthorization
+                        {
+                            ReAuthorization::ErrorOccurred,
+                            ReAuthorization::InvalidPassword
+                        });
+                        return;
+                    }
+
+                    authorize(d.username, true);
+                });
+            }
+            break;
 
-        case RtAuthorization::Signup:
+            case RtAuthorization::Signup:
+            {
+                send(PacketType::ReAuthorization, ReAuthorization
+                {
+                    ReAuthorization::ErrorOccurred,
+                    ReAuthorization::UserExists
+                });
+            }
+            break;
+            }
+        }
+        else
         {
-            QByteArray derived;
-            QByteArray salt;
-            derived.resize(64);
-            salt.resize(16);
+            switch (d.request)
+            {
+            case RtAuthorization::Signin:
+            {
+                send(PacketType::ReAuthorization, ReAuthorization
+                {
+                    ReAuthorization::ErrorOccurred,
+                    ReAuthorization::InvalidUsername
+                });
+            }
+            break;
 
-            rng.GenerateBlock(reinterpret_cast<quint8 *>(salt.data()), salt.size());
+            case RtAuthorization::Signup:
+            {
+                QByteArray salt;
+                salt.resize(16);
 
-            DeriveKey(derived, d.password, salt);
+                rng.GenerateBlock(reinterpret_cast<quint8 *>(salt.data()), salt.size());
 
-            query.prepare("INSERT INTO USERS (USERNAME, DERIVED, SALT)"
-                          " VALUES (?, ?, ?)");
-            query.addBindValue(d.username);
-            query.addBindValue(derived);
-            query.addBindValue(salt);
+                auto derived = QSharedPointer<QByteArray>::create();
 
-            if (!query.exec())
-            {
-                Server::error(query.lastError().text());
+                derive([ = ]
+                {
+                    *derived = Auth::derive(d.password, salt);
+                }, [ = ]
+                {
+                    execute("INSERT INTO USERS (USERNAME, DERIVED, SALT)"
+                            " VALUES (?, ?, ?)",
+                    {
+                        d.username,
+                        *derived,
+                        salt
+                    }, [ = ](const Database::Result &result)
+                    {
+                        if (!result.ok)
+                        {
+                            if (result.code == "23505")
+                            {
+                                send(PacketType::ReAuthorization, ReAuthorization
+                                {
+                                    ReAuthorization::ErrorOccurred,
+                                    ReAuthorization::UserExists
+                                });
+                                return;
+                            }
+
+                            Server::error(result.error);
+                        }
+
+                        authorize(d.username, true);
+                    });
+                });
+            }
+            break;
             }
         }
-        break;
-        }
+    });
+}
+
+void Client::execute(const QString &statement, const QVariantList &values, std::function<void(const Database::Result &)> done)
+{
+    auto result = QSharedPointer<Database::Result>::create();
+
+    execute([ = ]
+    {
+        Database::exec(statement, values, *result);
+    }, [ = ]
+    {
+        done(*result);
+    });
+}
+
+void Client::execute(std::function<void()> job, std::function<void()> done)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    auto accepted = dispatch(Database::getExecutor(), job, [ = ]
+    {
+        Stats::record("db.latency_us", timer.nsecsElapsed() / 1000);
+
+        done();
+    });
+
+    if (!accepted)
+    {
+        close("Database queue is full");
     }
+}
 
-    id = d.username;
-    Server::connected.insertMulti(id, this);
+void Client::derive(std::function<void()> job, std::function<void()> done)
+{
+    QElapsedTimer timer;
+    timer.start();
 
-    sendOne(PacketType::ReAuthorization, QVariant::fromValue(
-                ReAuthorization
+    auto accepted = dispatch(Auth::getExecutor(), job, [ = ]
     {
-        ReAuthorization::Authorized,
-        ReAuthorization::NoError
-    }));
+        Stats::record("auth.latency_us", timer.nsecsElapsed() / 1000);
 
-    QVector<Room> rooms;
+        done();
+    });
 
-    if (!query.exec("SELECT *"
-                    " FROM ROOMS"))
+    if (!accepted)
     {
-        Server::error(query.lastError().text());
+        send(PacketType::ReAuthorization, ReAuthorization
+        {
+            ReAuthorization::ErrorOccurred,
+            ReAuthorization::ServerBusy
+        });
     }
+}
 
-    while (query.next())
+void Client::authorize(const QByteArray &username, bool issue)
+{
+    id = username;
+    Server::connected.insert(id, member());
+
+    send(PacketType::ReAuthorization, ReAuthorization
     {
-        rooms.append(Room
+        ReAuthorization::Authorized,
+        ReAuthorization::NoError
+    });
+
+    execute("SELECT *"
+            " FROM ROOMS", {}, [ = ](const Database::Result &result)
+    {
+        if (!result.ok)
+        {
+            Server::error(result.error);
+        }
+
+        QVector<Room> rooms;
+
+        for (const auto &row : result.rows)
         {
-            query.value(0).toByteArray(),
-            query.value(1).toString()
+            rooms.append(Room
+            {
+                row.at(0).toByteArray(),
+                row.at(1).toString()
+            });
+        }
+
+        send(PacketType::Established, Established
+        {
+            Server::getSettings().value("Name").toString(),
+            Server::getSettings().value("Motd").toString(),
+            rooms,
+            quint32(isExtended() ? maxFrameSize : 0xFFFF)
         });
+
+        if (issue)
+        {
+            issueToken();
+        }
+    });
+}
+
+void Client::issueToken()
+{
+    if (Sessions::getLifetime() < 1)
+    {
+        return;
     }
 
-    sendOne(PacketType::Established, QVariant::fromValue(
-                Established
+    auto token = QSharedPointer<QByteArray>::create();
+    auto username = id;
+
+    execute([ = ]
+    {
+        *token = Sessions::issue(username);
+    }, [ = ]
     {
-        Server::getSettings().value("Name").toString(),
-        Server::getSettings().value("Motd").toString(),
-        rooms
-    }));
+        send(PacketType::SessionToken, SessionToken
+        {
+            *token,
+            Sessions::getLifetime()
+        });
+    });
 }
 
-void Client::doSynchronize(Synchronize d)
+void Client::doSynchronize(SynchronizeView d)
 {
     if (id_room.isEmpty())
     {
@@ -490,36 +915,39 @@ void Client::doSynchronize(Synchronize d)
         return;
     }
 
-    QSqlQuery query(Database::get());
-    query.prepare("SELECT * FROM ARCHIVE"
-                  " WHERE ID >"
-                  " ("
-                  " SELECT ID FROM ARCHIVE"
-                  " WHERE ID_MESSAGE = ?"
-                  " )"
-                  " AND ID_ROOM = ?");
-    query.addBindValue(d.id_message);
-    query.addBindValue(id_room);
+    d.detach();
 
-    if (!query.exec())
+    execute("SELECT * FROM ARCHIVE"
+            " WHERE ID >"
+            " ("
+            " SELECT ID FROM ARCHIVE"
+            " WHERE ID_MESSAGE = ?"
+            " )"
+            " AND ID_ROOM = ?",
     {
-        Server::error(query.lastError().text());
-    }
-
-    while (query.next())
+        d.id_message,
+        id_room
+    }, [ = ](const Database::Result &result)
     {
-        sendOne(PacketType::Message, QVariant::fromValue(
-                    Message
+        if (!result.ok)
         {
-            query.value(1).toLongLong(),
-            query.value(2).toByteArray(),
-            query.value(4).toString(),
-            query.value(5).toString()
-        }));
-    }
+            Server::error(result.error);
+        }
+
+        for (const auto &row : result.rows)
+        {
+            send(PacketType::Message, Message
+            {
+                row.at(1).toLongLong(),
+                row.at(2).toByteArray(),
+                row.at(4).toString(),
+                row.at(5).toString()
+            });
+        }
+    });
 }
 
-void Client::doMessage(Message d)
+void Client::doMessage(MessageView d)
 {
     if (id_room.isEmpty())
     {
@@ -530,148 +958,251 @@ void Client::doMessage(Message d)
     d.timestamp = QDateTime::currentSecsSinceEpoch();
     d.id_sender = id;
 
-    QSqlQuery query(Database::get());
-    query.prepare("INSERT INTO ARCHIVE (TIMESTAMP, ID_MESSAGE, ID_ROOM, ID_SENDER, CONTENT)"
-                  " VALUES (?, ?, ?, ?, ?)");
-    query.addBindValue(d.timestamp);
-    query.addBindValue(d.id);
-    query.addBindValue(id_room);
-    query.addBindValue(d.id_sender);
-    query.addBindValue(d.content);
+    d.detach();
 
-    if (!query.exec())
+    Archive::Entry entry
+    {
+        d.timestamp,
+        d.id,
+        id_room,
+        d.id_sender,
+        d.text()
+    };
+
+    if (Archive::isWriteBehind())
     {
-        if (query.lastError().nativeErrorCode() == "23505")
+        fanout(d);
+
+        archiving++;
+
+        Archive::submit(this, entry, [ = ](bool stored)
         {
-            close("Client sent a message, but another one with the same ID was found in the database");
-            return;
-        }
+            if (!stored && !interruptionRequested)
+            {
+                close("Client sent a message, but another one with the same ID was found in the database");
+            }
 
-        Server::error(query.lastError().text());
+            if (--archiving == 0)
+            {
+                emit archived();
+            }
+        });
+        return;
     }
 
-    for (const auto &participant : Server::participants.values(id_room))
+    suspended = true;
+
+    Archive::submit(this, entry, [ = ](bool stored)
     {
-        if (participant == this)
+        resume([ = ]
         {
-            continue;
-        }
+            if (!stored)
+            {
+                close("Client sent a message, but another one with the same ID was found in the database");
+                return;
+            }
 
-        QMetaObject::invokeMethod(participant, "sendOne",
-                                  Q_ARG(PacketType, PacketType::Message),
-                                  Q_ARG(QVariant, QVariant::fromValue(d)));
-    }
+            fanout(d);
+        });
+    });
 }
 
-void Client::doRtRoom(RtRoom d)
+void Client::fanout(const MessageView &d)
 {
-    switch (d.request)
-    {
-    case RtRoom::Join:
-    {
-        QSqlQuery query(Database::get());
-        query.prepare("SELECT 1"
-                      " FROM ROOMS"
-                      " WHERE ID = ?");
-        query.addBindValue(d.id);
+    QElapsedTimer timer;
+    timer.start();
+
+    auto participants = Server::participants.values(id_room);
 
-        if (!query.exec())
+    QByteArray payloads[PROTOCOL_VERSION + 1];
+    QByteArray sealed[PROTOCOL_VERSION + 1];
+
+    qint64 local = 0;
+    qint64 remote = 0;
+
+    for (const auto &participant : *participants)
+    {
+        if (participant.client == this)
         {
-            Server::error(query.lastError().text());
+            continue;
         }
 
-        if (!query.next())
+        auto &payload = payloads[participant.version];
+
+        if (payload.isEmpty())
         {
-            close("Client wants to enter a non-existent room");
-            return;
+            payload = serialize(d, participant.version);
         }
 
-        if (!id_room.isEmpty())
+        if (participant.group)
         {
-            leaveRoom();
+            auto &frame = sealed[participant.version];
+
+            if (frame.isEmpty())
+            {
+                frame = Groups::seal(id_room, PacketType::GroupMessage, payload, isExtendedFraming(participant.version));
+            }
+
+            if (!frame.isEmpty())
+            {
+                (deliver(participant, PacketType::GroupMessage, frame, true) ? local : remote)++;
+                continue;
+            }
         }
 
-        id_room = d.id;
+        (deliver(participant, PacketType::Message, payload) ? local : remote)++;
+    }
+
+    static const auto names = []() -> QVector<QByteArray>
+    {
+        QVector<QByteArray> names;
 
-        sendOne(PacketType::ReRoom, QVariant::fromValue(
-                    ReRoom
+        for (int i = 0; i <= 32; i++)
         {
-            ReRoom::Joined
-        }));
+            names.append("fanout.message_us." + QByteArray::number(quint64(1) << i));
+        }
 
-        QVector<QByteArray> uniqueUsers;
+        return names;
+    }();
 
-        auto notify = true;
+    auto size = qMax(quint32(participants->size()), 1u);
+
+    Stats::add("fanout.local", local);
+    Stats::add("fanout.remote", remote);
+    Stats::record(names[32 - qCountLeadingZeroBits(size - 1)], timer.nsecsElapsed() / 1000);
+    Stats::record("fanout.recipient_ns", timer.nsecsElapsed() / size);
+}
 
-        for (const auto &client : Server::connected.values(id))
+void Client::doRtRoom(RtRoom d)
+{
+    switch (d.request)
+    {
+    case RtRoom::Join:
+    case RtRoom::JoinGroup:
+    {
+        execute("SELECT 1"
+                " FROM ROOMS"
+                " WHERE ID = ?",
         {
-            if (client == this)
+            d.id
+        }, [ = ](const Database::Result &result)
+        {
+            if (!result.ok)
             {
-                continue;
+                Server::error(result.error);
             }
 
-            if (Server::participants.contains(id_room, client))
+            if (result.rows.isEmpty())
             {
-                notify = false;
-                break;
+                close("Client wants to enter a non-existent room");
+                return;
             }
+
+            joinRoom(d);
+        });
+    }
+    break;
+
+    case RtRoom::Leave:
+    {
+        if (id_room.isEmpty())
+        {
+            close("Client wants to leave the room without being in any room");
+            return;
         }
 
-        for (const auto &participant : Server::participants.values(id_room))
+        leaveRoom();
+
+        send(PacketType::ReRoom, ReRoom
         {
-            if (participant->id == id)
-            {
-                continue;
-            }
+            ReRoom::Left
+        });
+    }
+    break;
+    }
+}
 
-            if (!uniqueUsers.contains(participant->id))
-            {
-                uniqueUsers.append(participant->id);
+void Client::joinRoom(RtRoom d)
+{
+    if (!id_room.isEmpty())
+    {
+        leaveRoom();
+    }
 
-                sendOne(PacketType::UserState, QVariant::fromValue(
-                            UserState
-                {
-                    participant->id,
-                    UserState::Joined
-                }));
-            }
+    id_room = d.id;
+    group = d.request == RtRoom::JoinGroup && Groups::isEnabled();
 
-            if (!notify)
-            {
-                continue;
-            }
+    send(PacketType::ReRoom, ReRoom
+    {
+        ReRoom::Joined
+    });
+
+    QVector<QByteArray> uniqueUsers;
+
+    auto notify = true;
+
+    auto sessions = Server::connected.values(id);
+
+    for (const auto &session : *sessions)
+    {
+        if (session.client == this)
+        {
+            continue;
+        }
+
+        if (Server::participants.contains(id_room, session.client))
+        {
+            notify = false;
+            break;
+        }
+    }
 
-            QMetaObject::invokeMethod(participant, "sendOne",
-                                      Q_ARG(PacketType, PacketType::UserState),
-                                      Q_ARG(QVariant, QVariant::fromValue(
-                                                UserState
+    auto participants = Server::participants.values(id_room);
+    auto joined = serialize(UserState
+    {
+        id,
+        UserState::Joined
+    }, version);
+
+    for (const auto &participant : *participants)
+    {
+        if (participant.id == id)
+        {
+            continue;
+        }
+
+        if (!uniqueUsers.contains(participant.id))
+        {
+            uniqueUsers.append(participant.id);
+
+            send(PacketType::UserState, UserState
             {
-                id,
+                participant.id,
                 UserState::Joined
-            })));
+            });
+        }
+
+        if (!notify)
+        {
+            continue;
         }
 
-        Server::participants.insertMulti(d.id, this);
+        deliver(participant, PacketType::UserState, joined);
     }
-    break;
 
-    case RtRoom::Leave:
+    Server::participants.insert(d.id, member());
+
+    if (group)
     {
-        if (id_room.isEmpty())
+        for (const auto &key : Groups::getValid(id_room))
         {
-            close("Client wants to leave the room without being in any room");
-            return;
+            send(PacketType::GroupKey, key);
         }
-
-        leaveRoom();
-
-        sendOne(PacketType::ReRoom, QVariant::fromValue(
-                    ReRoom
-        {
-            ReRoom::Left
-        }));
     }
-    break;
+
+    if (Thread::hasRoomAffinity())
+    {
+        migration = Thread::getForRoom(id_room);
     }
 }
 
@@ -691,47 +1222,43 @@ void Client::doRtUpload(RtUpload d)
     {
         if (!file->exists())
         {
-            sendOne(PacketType::ReUpload, QVariant::fromValue(
-                        ReUpload
+            send(PacketType::ReUpload, ReUpload
             {
                 d.id,
                 ReUpload::ErrorOccurred,
                 ReUpload::NotFound
-            }));
+            });
             return;
         }
 
         if (!file->open(QIODevice::ReadOnly))
         {
-            sendOne(PacketType::ReUpload, QVariant::fromValue(
-                        ReUpload
+            send(PacketType::ReUpload, ReUpload
             {
                 d.id,
                 ReUpload::ErrorOccurred,
                 ReUpload::InternalServerError
-            }));
+            });
             return;
         }
 
         if (file->size() != d.size)
         {
-            sendOne(PacketType::ReUpload, QVariant::fromValue(
-                        ReUpload
+            send(PacketType::ReUpload, ReUpload
             {
                 d.id,
                 ReUpload::ErrorOccurred,
                 ReUpload::BadRequest
-            }));
+            });
             return;
         }
 
-        sendOne(PacketType::ReUpload, QVariant::fromValue(
-                    ReUpload
+        send(PacketType::ReUpload, ReUpload
         {
             d.id,
             ReUpload::ReadyWrite,
             ReUpload::NoError
-        }));
+        });
     }
     break;
 
@@ -751,35 +1278,32 @@ void Client::doRtUpload(RtUpload d)
 
         if (!file->open(QIODevice::WriteOnly))
         {
-            sendOne(PacketType::ReUpload, QVariant::fromValue(
-                        ReUpload
+            send(PacketType::ReUpload, ReUpload
             {
                 d.id,
                 ReUpload::ErrorOccurred,
                 ReUpload::InternalServerError
-            }));
+            });
             return;
         }
 
         if (!file->resize(d.size))
         {
-            sendOne(PacketType::ReUpload, QVariant::fromValue(
-                        ReUpload
+            send(PacketType::ReUpload, ReUpload
             {
                 d.id,
                 ReUpload::ErrorOccurred,
                 ReUpload::InternalServerError
-            }));
+            });
             return;
         }
 
-        sendOne(PacketType::ReUpload, QVariant::fromValue(
-                    ReUpload
+        send(PacketType::ReUpload, ReUpload
         {
             d.id,
             ReUpload::ReadyRead,
             ReUpload::NoError
-        }));
+        });
     }
     break;
     }
@@ -787,7 +1311,7 @@ void Client::doRtUpload(RtUpload d)
     usershare.insert(d.id, file);
 }
 
-void Client::doUpload(Upload d)
+void Client::doUpload(UploadView d)
 {
     if (!usershare.contains(d.id))
     {
@@ -815,21 +1339,19 @@ void Client::doUpload(Upload d)
     {
         usershare.remove(d.id);
 
-        sendOne(PacketType::UploadState, QVariant::fromValue(
-                    UploadState
+        send(PacketType::UploadState, UploadState
         {
             d.id,
             UploadState::Completed
-        }));
+        });
     }
     else
     {
-        sendOne(PacketType::UploadState, QVariant::fromValue(
-                    UploadState
+        send(PacketType::UploadState, UploadState
         {
             d.id,
             UploadState::Next
-        }));
+        });
     }
 }
 
@@ -853,12 +1375,11 @@ void Client::doUploadState(UploadState d)
             return;
         }
 
-        sendOne(PacketType::Upload, QVariant::fromValue(
-                    Upload
+        send(PacketType::Upload, Upload
         {
             d.id,
-            file->read()
-        }));
+            file->read(isExtended() ? maxFrameSize / 2 : TRANSFER_CHUNK)
+        });
     }
     break;
 
@@ -889,18 +1410,23 @@ void Client::doPong(Ping d)
 
 void Client::leaveRoom()
 {
-    Server::participants.remove(id_room, this);
+    if (Server::participants.remove(id_room, this) && Thread::hasRoomAffinity())
+    {
+        Thread::releaseRoom(id_room);
+    }
 
     auto notify = true;
 
-    for (const auto &client : Server::connected.values(id))
+    auto sessions = Server::connected.values(id);
+
+    for (const auto &session : *sessions)
     {
-        if (client == this)
+        if (session.client == this)
         {
             continue;
         }
 
-        if (Server::participants.contains(id_room, client))
+        if (Server::participants.contains(id_room, session.client))
         {
             notify = false;
             break;
@@ -909,28 +1435,151 @@ void Client::leaveRoom()
 
     if (notify)
     {
-        for (const auto &participant : Server::participants.values(id_room))
+        auto participants = Server::participants.values(id_room);
+        auto left = serialize(UserState
         {
-            if (participant->id == id)
+            id,
+            UserState::Left
+        }, version);
+
+        for (const auto &participant : *participants)
+        {
+            if (participant.id == id)
             {
                 continue;
             }
 
-            QMetaObject::invokeMethod(participant, "sendOne",
-                                      Q_ARG(PacketType, PacketType::UserState),
-                                      Q_ARG(QVariant, QVariant::fromValue(
-                                                UserState
-            {
-                id,
-                UserState::Left
-            })));
+            deliver(participant, PacketType::UserState, left);
         }
     }
 
+    if (group)
+    {
+        rekeyRoom();
+    }
+
     id_room.clear();
+    group = false;
+}
+
+void Client::rekeyRoom()
+{
+    auto next = Groups::rotate(id_room);
+    auto key = serialize(next, version);
+
+    auto participants = Server::participants.values(id_room);
+
+    for (const auto &participant : *participants)
+    {
+        if (participant.group)
+        {
+            deliver(participant, PacketType::GroupKey, key);
+        }
+    }
+
+    Groups::publish(id_room, next.epoch);
+}
+
+Registry::Member Client::member() const
+{
+    return
+    {
+        const_cast<Client *>(this),
+        Delivery::serial(const_cast<Client *>(this)),
+        id,
+        version,
+        group
+    };
+}
+
+bool Client::deliver(const Registry::Member &recipient, PacketType type, const QByteArray &payload, bool sealed)
+{
+    return Delivery::post(recipient.client, recipient.serial, type, payload, sealed);
+}
+
+template<typename T, void (Client::*handler)(T)>
+bool Client::decode(Client *client, const char *data, int size)
+{
+    PacketStream ds(QByteArray::fromRawData(data, size), client->version);
+
+    T d;
+    ds >> d;
+
+    if (ds.status() != QDataStream::Ok)
+    {
+        return false;
+    }
+
+    (client->*handler)(std::move(d));
+
+    return true;
+}
+
+template<typename T, void (Client::*handler)(T)>
+bool Client::decodeView(Client *client, const char *data, int size)
+{
+    PacketReader reader(data, size, client->version);
+
+    T d;
+    reader >> d;
+
+    if (!reader.isValid())
+    {
+        return false;
+    }
+
+    (client->*handler)(std::move(d));
+
+    return true;
+}
+
+template<typename T>
+QByteArray Client::serialize(const T &d, quint8 version)
+{
+    QByteArray out;
+    PacketStream ds(&out, QIODevice::WriteOnly, version);
+
+    ds << d;
+
+    return out;
+}
+
+template<typename T>
+void Client::send(PacketType type, const T &d)
+{
+    if (interruptionRequested)
+    {
+        return;
+    }
+
+    auto frame = acquireBuffer();
+    auto offset = headroom(true);
+
+    frame.resize(offset);
+
+    PacketStream ds(&frame, QIODevice::WriteOnly, version);
+    ds.device()->seek(offset);
+    ds << d;
+
+    writeFrame(type, frame, offset, frame.constData() + offset);
+}
+
+void Client::sendRaw(PacketType type, const QByteArray &payload)
+{
+    if (interruptionRequested)
+    {
+        return;
+    }
+
+    auto frame = acquireBuffer();
+    auto offset = headroom(!payload.isEmpty());
+
+    frame.resize(offset + payload.size());
+
+    writeFrame(type, frame, offset, payload.constData());
 }
 
-void Client::sendOne(PacketType type, const QVariant &v)
+void Client::sendFrame(const QByteArray &frame)
 {
     if (interruptionRequested)
     {
@@ -939,54 +1588,348 @@ void Client::sendOne(PacketType type, const QVariant &v)
 
     writing = true;
 
-    QByteArray out;
-    QVector<quint8> crypto[2];
+    transmit(frame, 0);
+
+    writing = false;
+    emit written();
+}
+
+bool Client::isExtended() const
+{
+    return encryption && isExtendedFraming(version);
+}
+
+int Client::nonceSize() const
+{
+    return hasTrafficKeys(version) ? 0 : sealer->nonceSize();
+}
+
+Parser::Framing Client::framing() const
+{
+    Parser::Framing framing;
+    framing.tag = encryption ? opener->tagSize() : 0;
+    framing.iv = encryption ? nonceSize() : 0;
+    framing.extended = isExtended();
+    framing.maximum = isExtended() ? maxFrameSize : 0xFFFF;
+
+    return framing;
+}
+
+int Client::headroom(bool payload) const
+{
+    if (!encryption)
+    {
+        return HEADER_SIZE;
+    }
+
+    auto crypto = payload ? sealer->tagSize() + nonceSize() : 0;
+
+    return (isExtended() ? EXTENDED_HEADER_SIZE : HEADER_SIZE) + crypto;
+}
+
+void Client::startEncryption()
+{
+    if (hasTrafficKeys(version))
+    {
+        outgoing.key = Crypto::derive(shared_secret, "neutron server traffic");
+        incoming.key = Crypto::derive(shared_secret, "neutron client traffic");
+    }
+    else
+    {
+        outgoing.key = shared_secret;
+        incoming.key = shared_secret;
+    }
+
+    outgoing.sequence = 0;
+    outgoing.bytes = 0;
+    incoming.sequence = 0;
+    incoming.bytes = 0;
+
+    sealer.reset(Aead::create(aead));
+    opener.reset(Aead::create(aead));
+
+    sealer->setKey(outgoing.key);
+    opener->setKey(incoming.key);
+
+    encryption = true;
+
+    Stats::add("aead." + aead);
+}
 
-    if (!v.isNull())
+bool Client::advance(Traffic &traffic, int length)
+{
+    traffic.sequence++;
+    traffic.bytes += quint64(length);
+
+    if ((rekeyPackets == 0 || traffic.sequence < rekeyPackets)
+            && (rekeyBytes == 0 || traffic.bytes < rekeyBytes))
+    {
+        return false;
+    }
+
+    traffic.key = Crypto::derive(traffic.key, "neutron traffic update");
+    traffic.sequence = 0;
+    traffic.bytes = 0;
+
+    Stats::add("crypto.rekeys");
+
+    return true;
+}
+
+bool Client::open(Parser::Frame &frame)
+{
+    auto tag = reinterpret_cast<const quint8 *>(frame.crypto);
+    auto iv = tag + opener->tagSize();
+
+    quint8 nonce[MAX_IV];
+
+    if (hasTrafficKeys(version))
+    {
+        counterNonce(nonce, opener->nonceSize(), incoming.sequence);
+        iv = nonce;
+    }
+
+    if (!opener->open(reinterpret_cast<quint8 *>(frame.payload),
+                      reinterpret_cast<const quint8 *>(frame.payload),
+                      frame.length,
+                      tag,
+                      iv))
+    {
+        return false;
+    }
+
+    if (hasTrafficKeys(version) && advance(incoming, frame.length))
+    {
+        opener->setKey(incoming.key);
+    }
+
+    return true;
+}
+
+void Client::writeFrame(PacketType type, QByteArray &frame, int offset, const char *payload)
+{
+    auto length = frame.size() - offset;
+
+    if (length > (isExtended() ? maxFrameSize : 0xFFFF))
+    {
+        releaseBuffer(frame);
+
+        close("Outgoing packet exceeds the maximum packet size");
+        return;
+    }
+
+    auto start = isExtended()
+                 ? sealExtended(type, frame, offset, payload)
+                 : seal(type, frame, offset, payload);
+
+    writing = true;
+
+    transmit(frame, start);
+
+    writing = false;
+    emit written();
+}
+
+int Client::seal(PacketType type, QByteArray &frame, int offset, const char *payload)
+{
+    auto length = frame.size() - offset;
+    auto data = frame.data();
+
+    data[0] = char(type);
+    qToBigEndian(quint16(length), data + 1);
+
+    if (offset > HEADER_SIZE)
+    {
+        auto tag = reinterpret_cast<quint8 *>(data + HEADER_SIZE);
+        auto iv = tag + sealer->tagSize();
+
+        rng.GenerateBlock(iv, size_t(sealer->nonceSize()));
+
+        sealer->seal(reinterpret_cast<quint8 *>(data + offset),
+                     reinterpret_cast<const quint8 *>(payload),
+                     length,
+                     tag,
+                     iv);
+    }
+    else if (payload != data + offset)
+    {
+        memcpy(data + offset, payload, size_t(length));
+    }
+
+    return 0;
+}
+
+int Client::sealExtended(PacketType type, QByteArray &frame, int offset, const char *payload)
+{
+    auto length = frame.size() - offset;
+    auto data = frame.data();
+    auto end = offset;
+
+    if (length > 0)
     {
-        QDataStream ds(&out, QIODevice::WriteOnly);
-        v.save(ds);
+        end = offset - sealer->tagSize() - nonceSize();
 
-        if (encryption)
+        auto tag = reinterpret_cast<quint8 *>(data + end);
+        auto iv = tag + sealer->tagSize();
+
+        quint8 nonce[MAX_IV];
+
+        if (hasTrafficKeys(version))
+        {
+            counterNonce(nonce, sealer->nonceSize(), outgoing.sequence);
+            iv = nonce;
+        }
+        else
         {
-            crypto[0].resize(enc.DigestSize());
-            crypto[1].resize(enc.DefaultIVLength());
+            rng.GenerateBlock(iv, size_t(sealer->nonceSize()));
+        }
 
-            enc.GetNextIV(rng, crypto[1].data());
-            enc.SetKeyWithIV(shared_secret.constData(),
-                             shared_secret.size(),
-                             crypto[1].constData(),
-                             crypto[1].size());
-            enc.EncryptAndAuthenticate(reinterpret_cast<quint8 *>(out.data()),
-                                       crypto[0].data(),
-                                       crypto[0].size(),
-                                       crypto[1].constData(),
-                                       crypto[1].size(),
-                                       nullptr,
-                                       0,
-                                       reinterpret_cast<const quint8 *>(out.constData()), out.size());
+        sealer->seal(reinterpret_cast<quint8 *>(data + offset),
+                     reinterpret_cast<const quint8 *>(payload),
+                     length,
+                     tag,
+                     iv);
+
+        if (hasTrafficKeys(version) && advance(outgoing, length))
+        {
+            sealer->setKey(outgoing.key);
         }
     }
 
-    QByteArray t;
-    QDataStream ds(&t, QIODevice::WriteOnly);
+    char header[EXTENDED_HEADER_SIZE];
+    header[0] = char(type);
+
+    auto size = 1 + encodeVarint(quint32(length), header + 1);
+    auto start = end - size;
+
+    memcpy(data + start, header, size_t(size));
+
+    return start;
+}
+
+void Client::transmit(const QByteArray &frame, int start)
+{
+    outbound.append(qMakePair(frame, start));
+
+    Thread::account(frame.size() - start);
+    traffic += frame.size() - start;
+
+    if (flushPending)
+    {
+        return;
+    }
+
+    flushPending = true;
+
+    QMetaObject::invokeMethod(this, [ = ]
+    {
+        flush();
+    }, Qt::QueuedConnection);
+}
+
+void Client::flush()
+{
+    flushPending = false;
+
+    if (outbound.isEmpty())
+    {
+        return;
+    }
+
+    QVector<QPair<QByteArray, int>> frames;
+    frames.swap(outbound);
+
+    if (socket->state() != QAbstractSocket::ConnectedState)
+    {
+        return;
+    }
+
+    Stats::add("write.frames", frames.size());
+    Stats::record("write.frames_per_flush", frames.size());
 
-    ds << quint8(type) << quint16(out.size());
+    int i = 0;
+    qint64 offset = frames[0].second;
 
-    if (!v.isNull())
+#ifdef MSG_NOSIGNAL
+    if (socket->bytesToWrite() == 0)
     {
-        if (!shared_secret.empty())
+        while (i < frames.size())
         {
-            ds.writeRawData(reinterpret_cast<const char *>(crypto[0].constData()), crypto[0].size());
-            ds.writeRawData(reinterpret_cast<const char *>(crypto[1].constData()), crypto[1].size());
-        }
+            iovec iov[MAX_IOV];
+            qint64 requested = 0;
+            int count = 0;
+
+            for (int j = i; j < frames.size() && count < MAX_IOV; j++, count++)
+            {
+                auto skip = j == i ? offset : frames[j].second;
+
+                iov[count].iov_base = const_cast<char *>(frames[j].first.constData()) + skip;
+                iov[count].iov_len = size_t(frames[j].first.size() - skip);
+
+                requested += frames[j].first.size() - skip;
+            }
+
+            msghdr msg = {};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+
+            auto sent = ::sendmsg(int(socket->socketDescriptor()), &msg, MSG_NOSIGNAL);
+
+            if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (sent <= 0)
+            {
+                break;
+            }
+
+            Stats::add("write.syscalls");
+            Stats::record("write.bytes_per_syscall", sent);
+
+            for (auto left = qint64(sent); left > 0;)
+            {
+                auto remaining = frames[i].first.size() - offset;
+
+                if (left < remaining)
+                {
+                    offset += left;
+                    break;
+                }
+
+                left -= remaining;
+                i++;
+                offset = i < frames.size() ? frames[i].second : 0;
+            }
 
-        ds.writeRawData(out.constData(), out.size());
+            if (sent < requested)
+            {
+                break;
+            }
+        }
     }
+#endif
 
-    socket->write(t.constData(), t.size());
-    socket->flush();
+    if (i < frames.size())
+    {
+        QByteArray rest = frames[i].first.mid(int(offset));
 
-    writing = false;
-    emit written();
+        while (++i < frames.size())
+        {
+            rest.append(frames[i].first.constData() + frames[i].second,
+                        frames[i].first.size() - frames[i].second);
+        }
+
+        socket->write(rest);
+        socket->flush();
+
+        Stats::add("write.syscalls");
+        Stats::record("write.bytes_per_syscall", rest.size());
+    }
+
+    for (auto &frame : frames)
+    {
+        releaseBuffer(frame.first);
+    }
 }
@@ -1,33 +1,54 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include "database.h"
 #include "packet.h"
+#include "parser.h"
+#include "registry.h"
 
 #include <QDataStream>
+#include <QElapsedTimer>
 #include <QHash>
+#include <QPair>
+#include <QScopedPointer>
 #include <QSharedPointer>
 #include <QTcpSocket>
 #include <QTimer>
 
-#include <cryptopp/chachapoly.h>
 #include <cryptopp/osrng.h>
 
+#include <functional>
+
+struct EphemeralKey;
+class Aead;
+class Executor;
 class File;
 class Client : public QObject
 {
     Q_OBJECT
+    friend class Delivery;
 public:
     explicit Client();
     ~Client();
 
+    static void prepare();
+
+    qint64 takeTraffic();
+    bool isPinned() const;
+    bool isMigratable() const;
+    bool migrate(QThread *);
+
+    void sendRaw(PacketType, const QByteArray &);
+    void sendFrame(const QByteArray &);
+
 public slots:
     void run(QTcpSocket *);
     void close(QString = {});
 
-    void sendOne(PacketType, const QVariant & = {});
-
 signals:
+    void archived();
     void read();
+    void resumed();
     void written();
 
 private slots:
@@ -35,42 +56,134 @@ private slots:
     void onReadyRead();
 
 private:
+    struct Route
+    {
+        PacketType type;
+        bool encrypted;
+        bool (*decode)(Client *, const char *, int);
+    };
+
+    static constexpr int routeCount = int(PacketType::Count);
+    static const Route routes[routeCount];
+
+    static constexpr bool isRouted(int i)
+    {
+        return i == routeCount || (int(routes[i].type) == i && isRouted(i + 1));
+    }
+
     QTcpSocket *socket;
-    QDataStream stream;
+    Parser parser;
 
     QByteArray id;
     QByteArray id_room;
+    bool group;
 
     bool interruptionRequested;
     bool reading;
+    bool suspended;
     bool writing;
+    int archiving;
 
     bool encryption;
     QVector<quint8> public_key;
     QVector<quint8> secret_key;
     QVector<quint8> shared_secret;
 
+    struct Traffic
+    {
+        QVector<quint8> key;
+        quint64 sequence;
+        quint64 bytes;
+    };
+
+    Traffic incoming;
+    Traffic outgoing;
+
+    QByteArray aead;
+    QScopedPointer<Aead> opener;
+    QScopedPointer<Aead> sealer;
+
     CryptoPP::AutoSeededRandomPool rng;
-    CryptoPP::XChaCha20Poly1305::Decryption dec;
-    CryptoPP::XChaCha20Poly1305::Encryption enc;
 
     QHash<QByteArray, QSharedPointer<File>> usershare;
 
+    qint64 traffic;
+    QThread *migration;
+
+    QElapsedTimer handshakeTimer;
+
+    QVector<QPair<QByteArray, int>> outbound;
+    bool flushPending;
+
+    quint8 version;
+
+    static bool noDelay;
+    static int maxFrameSize;
+    static quint64 rekeyPackets;
+    static quint64 rekeyBytes;
+    static int resumptionWindow;
+
+    QTimer *resumptionTimer;
     QTimer *disconnectTimer;
     QTimer *pingTimer;
     qint64 pingTimestamp;
 
+    bool dispatch(Executor &, std::function<void()>, std::function<void()>);
+    void resume(std::function<void()>);
+
+    template<typename T, void (Client::*)(T)>
+    static bool decode(Client *, const char *, int);
+
+    template<typename T, void (Client::*)(T)>
+    static bool decodeView(Client *, const char *, int);
+
+    template<typename T>
+    static QByteArray serialize(const T &, quint8);
+
+    template<typename T>
+    void send(PacketType, const T &);
+
+    void beginHandshake();
+    void startHandshake(const EphemeralKey &);
+    void issueTicket();
+
+    void execute(const QString &, const QVariantList &, std::function<void(const Database::Result &)>);
+    void execute(std::function<void()>, std::function<void()>);
+    void derive(std::function<void()>, std::function<void()>);
+    void authorize(const QByteArray &, bool);
+    void issueToken();
+
     void doHandshake(ClientKeyExchange);
+    void doResumption(Resumption);
     void doRtAuthorization(RtAuthorization);
-    void doSynchronize(Synchronize);
-    void doMessage(Message);
+    void doSynchronize(SynchronizeView);
+    void doMessage(MessageView);
     void doRtRoom(RtRoom);
     void doRtUpload(RtUpload);
-    void doUpload(Upload);
+    void doUpload(UploadView);
     void doUploadState(UploadState);
     void doPong(Ping);
 
+    void fanout(const MessageView &);
+    void joinRoom(RtRoom);
     void leaveRoom();
+    void rekeyRoom();
+    Registry::Member member() const;
+    bool deliver(const Registry::Member &, PacketType, const QByteArray &, bool = false);
+    bool isExtended() const;
+    int nonceSize() const;
+    Parser::Framing framing() const;
+    int headroom(bool) const;
+
+    void startEncryption();
+    static bool advance(Traffic &, int);
+    bool open(Parser::Frame &);
+
+    void writeFrame(PacketType, QByteArray &, int, const char *);
+    int seal(PacketType, QByteArray &, int, const char *);
+    int sealExtended(PacketType, QByteArray &, int, const char *);
+    void transmit(const QByteArray &, int);
+    void flush();
 };
 
 #endif // CLIENT_H
@@ -0,0 +1,339 @@
+#include "crypto.h"
+#include "aead.h"
+#include "packet.h"
+#include "server.h"
+#include "stats.h"
+
+#include <QtDebug>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <QThread>
+
+#include <QtEndian>
+
+#include <cryptopp/chachapoly.h>
+#include <cryptopp/hkdf.h>
+#include <cryptopp/osrng.h>
+#include <cryptopp/sha3.h>
+using CryptoPP::AutoSeededRandomPool;
+using CryptoPP::HKDF;
+using CryptoPP::SHA3_256;
+using CryptoPP::XChaCha20Poly1305;
+
+#if defined(OQS_KEM_alg_sike_p751) && defined(OQS_SIG_alg_picnic2_L5_FS)
+static const char DEFAULT_KEM[] = OQS_KEM_alg_sike_p751;
+static const char DEFAULT_SIG[] = OQS_SIG_alg_picnic2_L5_FS;
+#else
+static const char DEFAULT_KEM[] = "ML-KEM-1024";
+static const char DEFAULT_SIG[] = "ML-DSA-87";
+#endif
+
+Executor Crypto::executor("crypto");
+OQS_KEM *Crypto::kem = nullptr;
+OQS_SIG *Crypto::sig = nullptr;
+
+static double trafficRate(int size, bool cached)
+{
+    AutoSeededRandomPool rng;
+
+    quint8 key[32];
+    quint8 iv[24] = {};
+    quint8 tag[16];
+
+    rng.GenerateBlock(key, sizeof(key));
+
+    QByteArray buffer(size, 0);
+    auto data = reinterpret_cast<quint8 *>(buffer.data());
+
+    XChaCha20Poly1305::Encryption enc;
+    XChaCha20Poly1305::Decryption dec;
+
+    enc.SetKeyWithIV(key, sizeof(key), iv, sizeof(iv));
+    dec.SetKeyWithIV(key, sizeof(key), iv, sizeof(iv));
+
+    quint64 packets = 0;
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while (timer.elapsed() < 1000)
+    {
+        if (cached)
+        {
+            qToBigEndian(packets, iv);
+        }
+        else
+        {
+            rng.GenerateBlock(iv, sizeof(iv));
+            enc.SetKeyWithIV(key, sizeof(key), iv, sizeof(iv));
+        }
+
+        enc.EncryptAndAuthenticate(data, tag, sizeof(tag), iv, sizeof(iv), nullptr, 0, data, size);
+
+        if (!cached)
+        {
+            dec.SetKeyWithIV(key, sizeof(key), iv, sizeof(iv));
+        }
+
+        if (!dec.DecryptAndVerify(data, tag, sizeof(tag), iv, sizeof(iv), nullptr, 0, data, size))
+        {
+            return 0;
+        }
+
+        packets++;
+    }
+
+    return packets * 1e9 / timer.nsecsElapsed();
+}
+
+void Crypto::prepare()
+{
+    auto &settings = Server::getSettings();
+
+    auto kemName = settings.value("Kem", DEFAULT_KEM).toByteArray();
+    auto sigName = settings.value("Sig", DEFAULT_SIG).toByteArray();
+
+    kem = OQS_KEM_new(kemName.constData());
+    sig = OQS_SIG_new(sigName.constData());
+
+    if (kem == nullptr || sig == nullptr)
+    {
+        Server::error("The required post quantum algorithms are not available for use");
+    }
+
+    if (kem->length_shared_secret != 32)
+    {
+        Server::error("The key encapsulation mechanism must produce a 32-byte shared secret");
+    }
+
+    if (sig->length_public_key + kem->length_public_key + sig->length_signature > 0xFFFF)
+    {
+        qWarning().noquote() << QString("Handshake with %1 and %2 may exceed the maximum packet size")
+                             .arg(kem->method_name)
+                             .arg(sig->method_name);
+    }
+
+    qInfo().noquote() << "Key encapsulation:" << kem->method_name;
+    qInfo().noquote() << "Signature:" << sig->method_name;
+
+    executor.prepare(settings.value("CryptoThreads", qMax(QThread::idealThreadCount() / 2, 1)).toInt(),
+                     settings.value("CryptoQueue", 256).toInt());
+}
+
+void Crypto::benchmark()
+{
+    static const char *suites[][2] =
+    {
+        { "SIKE-p751", "picnic2_L5_FS" },
+        { "Kyber1024", "DILITHIUM_5" },
+        { "Kyber1024", "Dilithium5" },
+        { "Kyber768", "DILITHIUM_3" },
+        { "Kyber768", "Dilithium3" },
+        { "ML-KEM-1024", "ML-DSA-87" },
+        { "ML-KEM-768", "ML-DSA-65" }
+    };
+
+    for (const auto &suite : suites)
+    {
+        auto k = OQS_KEM_new(suite[0]);
+        auto s = OQS_SIG_new(suite[1]);
+
+        if (k == nullptr || s == nullptr)
+        {
+            OQS_KEM_free(k);
+            OQS_SIG_free(s);
+            continue;
+        }
+
+        QVector<quint8> public_key(s->length_public_key);
+        QVector<quint8> secret_key(s->length_secret_key);
+        OQS_SIG_keypair(s, public_key.data(), secret_key.data());
+
+        QVector<quint8> ciphertext(k->length_ciphertext);
+        QVector<quint8> shared_secret(k->length_shared_secret);
+
+        int handshakes = 0;
+        qint64 server = 0;
+        qint64 client = 0;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        while (timer.elapsed() < 2000 || handshakes < 3)
+        {
+            auto key = generate(k, s, secret_key);
+
+            if (key.signature.isEmpty())
+            {
+                break;
+            }
+
+            OQS_KEM_encaps(k, ciphertext.data(), shared_secret.data(), key.public_key.constData());
+
+            if (decapsulate(k, ciphertext, key.secret_key).isEmpty())
+            {
+                break;
+            }
+
+            QByteArray skx;
+            QByteArray ckx;
+            QDataStream sds(&skx, QIODevice::WriteOnly);
+            QDataStream cds(&ckx, QIODevice::WriteOnly);
+
+            sds << ServerKeyExchange
+            {
+                {
+                    public_key,
+                    key.public_key
+                },
+                key.signature,
+                k->method_name,
+                s->method_name,
+                PROTOCOL_VERSION,
+                0,
+                0,
+                { DEFAULT_AEAD }
+            };
+
+            cds << ClientKeyExchange
+            {
+                ciphertext,
+                PROTOCOL_VERSION,
+                DEFAULT_AEAD
+            };
+
+            server += 3 + skx.size();
+            client += 3 + ckx.size();
+
+            handshakes++;
+        }
+
+        auto elapsed = timer.nsecsElapsed();
+
+        if (handshakes > 0)
+        {
+            qInfo().noquote() << QString("%1 + %2: %3 handshakes/s, %4 bytes from server, %5 bytes from client")
+                              .arg(k->method_name)
+                              .arg(s->method_name)
+                              .arg(handshakes * 1e9 / elapsed, 0, 'f', 1)
+                              .arg(server / handshakes)
+                              .arg(client / handshakes);
+        }
+
+        OQS_KEM_free(k);
+        OQS_SIG_free(s);
+    }
+
+    for (auto size : { 64, 256, 1024 })
+    {
+        qInfo().noquote() << QString("%1-byte frames: %2 packets/s with a random IV and key setup per packet, %3 packets/s with cached traffic keys and counter nonces")
+                          .arg(size)
+                          .arg(trafficRate(size, false), 0, 'f', 0)
+                          .arg(trafficRate(size, true), 0, 'f', 0);
+    }
+}
+
+Executor &Crypto::getExecutor()
+{
+    return executor;
+}
+
+const OQS_KEM *Crypto::getKem()
+{
+    return kem;
+}
+
+const OQS_SIG *Crypto::getSig()
+{
+    return sig;
+}
+
+EphemeralKey Crypto::generate()
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    auto key = generate(kem, sig, Server::getSecretKey());
+
+    Stats::record("crypto.generate_us", timer.nsecsElapsed() / 1000);
+
+    return key;
+}
+
+QVector<quint8> Crypto::decapsulate(const QVector<quint8> &ciphertext, const QVector<quint8> &secret_key)
+{
+    return decapsulate(kem, ciphertext, secret_key);
+}
+
+QVector<quint8> Crypto::derive(const QVector<quint8> &secret, const QByteArray &info, const QByteArray &salt)
+{
+    QVector<quint8> derived(32);
+
+    HKDF<SHA3_256> hkdf;
+    hkdf.DeriveKey(derived.data(), derived.size(),
+                   secret.constData(), secret.size(),
+                   reinterpret_cast<const quint8 *>(salt.constData()), salt.size(),
+                   reinterpret_cast<const quint8 *>(info.constData()), info.size());
+
+    return derived;
+}
+
+EphemeralKey Crypto::generate(const OQS_KEM *kem, const OQS_SIG *sig, const QVector<quint8> &secret)
+{
+    EphemeralKey key;
+    key.public_key.resize(kem->length_public_key);
+    key.secret_key.resize(kem->length_secret_key);
+    key.signature.resize(sig->length_signature);
+
+    OQS_STATUS rc;
+
+    rc = OQS_KEM_keypair(kem,
+                         key.public_key.data(),
+                         key.secret_key.data());
+
+    if (rc != OQS_SUCCESS)
+    {
+        return {};
+    }
+
+    size_t signature_len;
+
+    rc = OQS_SIG_sign(sig,
+                      key.signature.data(),
+                      &signature_len,
+                      key.public_key.constData(),
+                      key.public_key.size(),
+                      secret.constData());
+
+    if (rc != OQS_SUCCESS)
+    {
+        return {};
+    }
+
+    key.signature.resize(signature_len);
+
+    return key;
+}
+
+QVector<quint8> Crypto::decapsulate(const OQS_KEM *kem, const QVector<quint8> &ciphertext, const QVector<quint8> &secret_key)
+{
+    if (size_t(ciphertext.size()) != kem->length_ciphertext
+            || size_t(secret_key.size()) != kem->length_secret_key)
+    {
+        return {};
+    }
+
+    QVector<quint8> shared_secret(kem->length_shared_secret);
+
+    auto rc = OQS_KEM_decaps(kem,
+                             shared_secret.data(),
+                             ciphertext.constData(),
+                             secret_key.constData());
+
+    if (rc != OQS_SUCCESS)
+    {
+        return {};
+    }
+
+    return shared_secret;
+}
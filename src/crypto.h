@@ -0,0 +1,47 @@
+#ifndef CRYPTO_H
+#define CRYPTO_H
+
+#include "executor.h"
+
+#include <QVector>
+
+#ifdef __cplusplus
+extern "C" {
+#include <oqs/oqs.h>
+}
+#endif
+
+struct EphemeralKey
+{
+    QVector<quint8> public_key;
+    QVector<quint8> secret_key;
+    QVector<quint8> signature;
+};
+
+class Crypto
+{
+public:
+    static void prepare();
+    static void benchmark();
+
+    static Executor &getExecutor();
+
+    static const OQS_KEM *getKem();
+    static const OQS_SIG *getSig();
+
+    static EphemeralKey generate();
+    static QVector<quint8> decapsulate(const QVector<quint8> &, const QVector<quint8> &);
+
+    static QVector<quint8> derive(const QVector<quint8> &, const QByteArray &, const QByteArray & = {});
+
+private:
+    static Executor executor;
+
+    static OQS_KEM *kem;
+    static OQS_SIG *sig;
+
+    static EphemeralKey generate(const OQS_KEM *, const OQS_SIG *, const QVector<quint8> &);
+    static QVector<quint8> decapsulate(const OQS_KEM *, const QVector<quint8> &, const QVector<quint8> &);
+};
+
+#endif // CRYPTO_H
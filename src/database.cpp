@@ -1,9 +1,27 @@
 #include "database.h"
+#include "server.h"
+#include "stats.h"
 
+#include <QSqlError>
+#include <QSqlRecord>
+
+Executor Database::executor("db");
+QMutex Database::mutex;
 QHash<QThread *, QSqlDatabase> Database::pool;
+QThreadStorage<QHash<QString, QSharedPointer<QSqlQuery>>> Database::statements;
+
+void Database::prepare()
+{
+    auto &settings = Server::getSettings();
+
+    executor.prepare(settings.value("DbThreads", 4).toInt(),
+                     settings.value("DbQueue", 1024).toInt());
+}
 
 QSqlDatabase Database::get(QThread *thread)
 {
+    QMutexLocker locker(&mutex);
+
     QSqlDatabase db;
 
     if (pool.contains(thread))
@@ -21,3 +39,64 @@ QSqlDatabase Database::get(QThread *thread)
 
     return db;
 }
+
+Executor &Database::getExecutor()
+{
+    return executor;
+}
+
+void Database::exec(const QString &statement, const QVariantList &values, Result &result)
+{
+    auto &cache = statements.localData();
+    auto query = cache.value(statement);
+
+    if (query.isNull())
+    {
+        query = QSharedPointer<QSqlQuery>::create(get());
+
+        if (!query->prepare(statement))
+        {
+            result.ok = false;
+            result.error = query->lastError().text();
+            result.code = query->lastError().nativeErrorCode();
+            return;
+        }
+
+        cache.insert(statement, query);
+
+        Stats::add("db.prepared");
+    }
+
+    for (int i = 0; i < values.size(); i++)
+    {
+        query->bindValue(i, values.at(i));
+    }
+
+    result.ok = query->exec();
+
+    if (!result.ok)
+    {
+        result.error = query->lastError().text();
+        result.code = query->lastError().nativeErrorCode();
+
+        query->finish();
+        return;
+    }
+
+    auto columns = query->record().count();
+
+    while (query->next())
+    {
+        QVariantList row;
+        row.reserve(columns);
+
+        for (int i = 0; i < columns; i++)
+        {
+            row.append(query->value(i));
+        }
+
+        result.rows.append(row);
+    }
+
+    query->finish();
+}
@@ -1,17 +1,42 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
+#include "executor.h"
+
 #include <QHash>
+#include <QMutex>
+#include <QSharedPointer>
 #include <QSqlDatabase>
+#include <QSqlQuery>
 #include <QThread>
+#include <QThreadStorage>
+#include <QVariantList>
+#include <QVector>
 
 class Database
 {
 public:
+    struct Result
+    {
+        bool ok;
+        QString error;
+        QString code;
+        QVector<QVariantList> rows;
+    };
+
+    static void prepare();
+
     static QSqlDatabase get(QThread * = QThread::currentThread());
+    static Executor &getExecutor();
+
+    static void exec(const QString &, const QVariantList &, Result &);
 
 private:
+    static Executor executor;
+
+    static QMutex mutex;
     static QHash<QThread *, QSqlDatabase> pool;
+    static QThreadStorage<QHash<QString, QSharedPointer<QSqlQuery>>> statements;
 };
 
 #endif // DATABASE_H
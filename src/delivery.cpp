@@ -0,0 +1,267 @@
+#include "delivery.h"
+#include "client.h"
+#include "stats.h"
+
+#include <QtDebug>
+#include <QAtomicInteger>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QThread>
+
+static constexpr int BENCHMARK_MESSAGES = 20000;
+static constexpr int BENCHMARK_ROOM = 64;
+static constexpr int BENCHMARK_PAYLOAD = 256;
+
+QReadWriteLock Delivery::lock;
+QHash<QThread *, Delivery *> Delivery::queues;
+QHash<Client *, QPair<quint64, Delivery *>> Delivery::recipients;
+quint64 Delivery::counter = 0;
+
+void Delivery::benchmark()
+{
+    static const int counts[] = { 0, 1, 2, 4 };
+
+    auto payload = QByteArray(BENCHMARK_PAYLOAD, 'x');
+
+    for (auto count : counts)
+    {
+        QAtomicInteger<qint64> written(0);
+
+        QVector<QThread *> threads;
+        QVector<Client *> clients;
+        QVector<quint64> serials;
+
+        for (int i = 0; i < count; i++)
+        {
+            auto thread = new QThread;
+            thread->start();
+
+            threads.append(thread);
+        }
+
+        for (int r = 0; r < BENCHMARK_ROOM; r++)
+        {
+            auto thread = count == 0 ? QThread::currentThread() : threads[r % count];
+
+            auto client = new Client;
+            client->socket = new QTcpSocket;
+
+            QObject::connect(client, &Client::written, [&written]
+            {
+                written++;
+            });
+
+            client->socket->moveToThread(thread);
+            client->moveToThread(thread);
+
+            attach(client, thread);
+
+            clients.append(client);
+            serials.append(serial(client));
+        }
+
+        qint64 hops = 0;
+
+        QElapsedTimer clock;
+        clock.start();
+
+        for (int m = 0; m < BENCHMARK_MESSAGES; m++)
+        {
+            for (int r = 0; r < BENCHMARK_ROOM; r++)
+            {
+                if (!post(clients[r], serials[r], PacketType::Message, payload, false))
+                {
+                    hops++;
+                }
+            }
+
+            QCoreApplication::processEvents();
+        }
+
+        qint64 total = qint64(BENCHMARK_MESSAGES) * BENCHMARK_ROOM;
+
+        while (written.load() < total)
+        {
+            QCoreApplication::processEvents();
+            QThread::yieldCurrentThread();
+        }
+
+        auto elapsed = clock.nsecsElapsed();
+
+        for (auto client : clients)
+        {
+            if (client->thread() == QThread::currentThread())
+            {
+                delete client;
+                continue;
+            }
+
+            QMetaObject::invokeMethod(client, [ = ]
+            {
+                delete client;
+            }, Qt::BlockingQueuedConnection);
+        }
+
+        for (auto thread : threads)
+        {
+            lock.lockForWrite();
+            auto queue = queues.take(thread);
+            lock.unlock();
+
+            QMetaObject::invokeMethod(queue, [ = ]
+            {
+                delete queue;
+            }, Qt::BlockingQueuedConnection);
+
+            thread->quit();
+            thread->wait();
+
+            delete thread;
+        }
+
+        qInfo().noquote() << QString("Delivery, %1: %2 deliveries/s, %3 hops per delivery")
+                          .arg(count == 0
+                               ? QString("same thread")
+                               : QString("%1 threads").arg(count))
+                          .arg(total * 1e9 / elapsed, 0, 'f', 0)
+                          .arg(double(hops) / total, 0, 'f', 2);
+    }
+}
+
+void Delivery::attach(Client *client, QThread *thread)
+{
+    QWriteLocker locker(&lock);
+
+    auto queue = queues.value(thread);
+
+    if (queue == nullptr)
+    {
+        queue = new Delivery;
+        queue->moveToThread(thread);
+
+        queues.insert(thread, queue);
+    }
+
+    auto serial = recipients.contains(client)
+                  ? recipients.value(client).first
+                  : ++counter;
+
+    recipients.insert(client, qMakePair(serial, queue));
+}
+
+void Delivery::detach(Client *client)
+{
+    QWriteLocker locker(&lock);
+    recipients.remove(client);
+}
+
+quint64 Delivery::serial(Client *client)
+{
+    QReadLocker locker(&lock);
+    return recipients.value(client).first;
+}
+
+bool Delivery::post(Client *recipient, quint64 serial, PacketType type, const QByteArray &payload, bool sealed)
+{
+    QReadLocker locker(&lock);
+
+    auto it = recipients.constFind(recipient);
+
+    if (it == recipients.constEnd() || it->first != serial)
+    {
+        Stats::add("delivery.dropped");
+        return false;
+    }
+
+    if (it->second->thread() == QThread::currentThread() && it->second->isIdle())
+    {
+        locker.unlock();
+
+        if (sealed)
+        {
+            recipient->sendFrame(payload);
+        }
+        else
+        {
+            recipient->sendRaw(type, payload);
+        }
+
+        return true;
+    }
+
+    it->second->enqueue(Entry
+    {
+        recipient,
+        serial,
+        type,
+        payload,
+        sealed
+    });
+
+    return false;
+}
+
+bool Delivery::isIdle()
+{
+    QMutexLocker locker(&mutex);
+    return entries.isEmpty();
+}
+
+void Delivery::enqueue(const Entry &entry)
+{
+    mutex.lock();
+
+    auto wake = entries.isEmpty();
+    entries.append(entry);
+
+    mutex.unlock();
+
+    if (wake)
+    {
+        QMetaObject::invokeMethod(this, [ = ]
+        {
+            drain();
+        }, Qt::QueuedConnection);
+    }
+}
+
+void Delivery::drain()
+{
+    QVector<Entry> batch;
+
+    mutex.lock();
+    batch.swap(entries);
+    mutex.unlock();
+
+    Stats::add("delivery.batches");
+    Stats::record("delivery.batch_size", batch.size());
+
+    for (const auto &entry : batch)
+    {
+        QReadLocker locker(&lock);
+
+        auto it = recipients.constFind(entry.recipient);
+
+        if (it == recipients.constEnd() || it->first != entry.serial)
+        {
+            continue;
+        }
+
+        if (it->second != this)
+        {
+            it->second->enqueue(entry);
+            continue;
+        }
+
+        locker.unlock();
+
+        if (entry.sealed)
+        {
+            entry.recipient->sendFrame(entry.payload);
+        }
+        else
+        {
+            entry.recipient->sendRaw(entry.type, entry.payload);
+        }
+    }
+}
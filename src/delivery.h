@@ -0,0 +1,49 @@
+#ifndef DELIVERY_H
+#define DELIVERY_H
+
+#include "packet.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QPair>
+#include <QReadWriteLock>
+#include <QVector>
+
+class Client;
+class Delivery : public QObject
+{
+    Q_OBJECT
+public:
+    static void benchmark();
+
+    static void attach(Client *, QThread *);
+    static void detach(Client *);
+
+    static quint64 serial(Client *);
+    static bool post(Client *, quint64, PacketType, const QByteArray &, bool);
+
+private:
+    struct Entry
+    {
+        Client *recipient;
+        quint64 serial;
+        PacketType type;
+        QByteArray payload;
+        bool sealed;
+    };
+
+    QMutex mutex;
+    QVector<Entry> entries;
+
+    static QReadWriteLock lock;
+    static QHash<QThread *, Delivery *> queues;
+    static QHash<Client *, QPair<quint64, Delivery *>> recipients;
+    static quint64 counter;
+
+    bool isIdle();
+    void enqueue(const Entry &);
+    void drain();
+};
+
+#endif // DELIVERY_H
@@ -0,0 +1,76 @@
+#include "executor.h"
+#include "stats.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QRunnable>
+
+namespace
+{
+class Task : public QRunnable
+{
+public:
+    explicit Task(std::function<void()> f) : f(f)
+    {
+    }
+
+    void run() override
+    {
+        f();
+    }
+
+private:
+    std::function<void()> f;
+};
+}
+
+Executor::Executor(const QByteArray &name)
+    : name(name)
+    , pool(nullptr)
+    , limit(0)
+{
+}
+
+void Executor::prepare(int threads, int limit)
+{
+    pool = new QThreadPool(qApp);
+    pool->setMaxThreadCount(qMax(threads, 1));
+    pool->setExpiryTimeout(-1);
+
+    this->limit = qMax(limit, 1);
+}
+
+bool Executor::submit(QObject *context, std::function<void()> job, std::function<void()> done)
+{
+    auto depth = queued.fetchAndAddOrdered(1);
+
+    if (depth >= limit)
+    {
+        queued.fetchAndSubOrdered(1);
+        Stats::add(name + ".rejected");
+        return false;
+    }
+
+    Stats::record(name + ".queue", depth);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    pool->start(new Task([ = ]
+    {
+        Stats::record(name + ".wait_us", timer.nsecsElapsed() / 1000);
+
+        QElapsedTimer elapsed;
+        elapsed.start();
+
+        job();
+
+        Stats::record(name + ".run_us", elapsed.nsecsElapsed() / 1000);
+
+        queued.fetchAndSubOrdered(1);
+
+        QMetaObject::invokeMethod(context, done, Qt::QueuedConnection);
+    }));
+
+    return true;
+}
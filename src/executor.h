@@ -0,0 +1,25 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <QAtomicInt>
+#include <QThreadPool>
+
+#include <functional>
+
+class Executor
+{
+public:
+    explicit Executor(const QByteArray &);
+
+    void prepare(int, int);
+
+    bool submit(QObject *, std::function<void()>, std::function<void()>);
+
+private:
+    QByteArray name;
+    QThreadPool *pool;
+    QAtomicInt queued;
+    int limit;
+};
+
+#endif // EXECUTOR_H
@@ -1,8 +1,6 @@
 #include "file.h"
 #include "server.h"
 
-static constexpr qint64 PAGE_SIZE = 32768;
-
 File::File(const QString &name) : QFile(name)
 {
 }
@@ -28,10 +26,10 @@ qint64 File::getRemained() const
     return size() - pos();
 }
 
-QByteArray File::read()
+QByteArray File::read(qint64 size)
 {
     QByteArray data;
-    data.resize(qMin(getRemained(), PAGE_SIZE));
+    data.resize(int(qMin(getRemained(), size)));
 
     if (qint64(data.size()) != QIODevice::read(data.data(), data.size()))
     {
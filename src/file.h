@@ -14,7 +14,7 @@ public:
 
     qint64 getRemained() const;
 
-    QByteArray read();
+    QByteArray read(qint64);
     void write(const QByteArray &);
 };
 
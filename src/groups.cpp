@@ -0,0 +1,178 @@
+#include "groups.h"
+#include "server.h"
+#include "stats.h"
+
+#include <QtEndian>
+
+#include <cryptopp/chachapoly.h>
+#include <cryptopp/osrng.h>
+using CryptoPP::AutoSeededRandomPool;
+using CryptoPP::XChaCha20Poly1305;
+
+static constexpr int KEY_SIZE = 32;
+static constexpr int HEADER_SIZE = 10;
+static constexpr int IV_SIZE = 24;
+static constexpr int TAG_SIZE = 16;
+
+bool Groups::enabled = false;
+QReadWriteLock Groups::lock;
+QHash<QByteArray, Groups::Room> Groups::rooms;
+quint32 Groups::counter = 0;
+QThreadStorage<AutoSeededRandomPool *> Groups::rngs;
+
+void Groups::prepare()
+{
+    enabled = Server::getSettings().value("GroupKeys", false).toBool();
+}
+
+bool Groups::isEnabled()
+{
+    return enabled;
+}
+
+GroupKey Groups::get(const QByteArray &id_room)
+{
+    QReadLocker locker(&lock);
+
+    auto it = rooms.constFind(id_room);
+
+    if (it != rooms.constEnd())
+    {
+        return it->current;
+    }
+
+    locker.unlock();
+
+    QWriteLocker writeLocker(&lock);
+
+    if (!rooms.contains(id_room))
+    {
+        rooms.insert(id_room, Room
+        {
+            generate(id_room),
+            GroupKey { id_room, 0, {} }
+        });
+    }
+
+    return rooms.value(id_room).current;
+}
+
+QVector<GroupKey> Groups::getValid(const QByteArray &id_room)
+{
+    get(id_room);
+
+    QReadLocker locker(&lock);
+
+    auto room = rooms.value(id_room);
+
+    QVector<GroupKey> valid { room.current };
+
+    if (room.pending.epoch != 0)
+    {
+        valid.append(room.pending);
+    }
+
+    return valid;
+}
+
+GroupKey Groups::rotate(const QByteArray &id_room)
+{
+    get(id_room);
+
+    QWriteLocker locker(&lock);
+
+    auto key = generate(id_room);
+    rooms[id_room].pending = key;
+
+    Stats::add("groups.rotations");
+
+    return key;
+}
+
+void Groups::publish(const QByteArray &id_room, quint32 epoch)
+{
+    QWriteLocker locker(&lock);
+
+    auto it = rooms.find(id_room);
+
+    if (it == rooms.end() || it->pending.epoch != epoch)
+    {
+        return;
+    }
+
+    it->current = it->pending;
+    it->pending.epoch = 0;
+    it->pending.key.clear();
+}
+
+QByteArray Groups::seal(const QByteArray &id_room, PacketType type, const QByteArray &payload, bool extended)
+{
+    if (payload.isEmpty() || (!extended && payload.size() > 0xFFFF))
+    {
+        return {};
+    }
+
+    auto key = get(id_room);
+
+    char header[HEADER_SIZE];
+    header[0] = char(type);
+
+    int size;
+
+    if (extended)
+    {
+        size = 1 + encodeVarint(quint32(payload.size()), header + 1);
+    }
+    else
+    {
+        qToBigEndian(quint16(payload.size()), header + 1);
+        size = 3;
+    }
+
+    qToBigEndian(key.epoch, header + size);
+    size += 4;
+
+    QByteArray frame(header, size);
+    frame.resize(size + TAG_SIZE + IV_SIZE);
+    frame.append(payload);
+
+    auto data = reinterpret_cast<quint8 *>(frame.data());
+
+    getRng().GenerateBlock(data + size + TAG_SIZE, IV_SIZE);
+
+    XChaCha20Poly1305::Encryption enc;
+    enc.SetKeyWithIV(key.key.constData(), key.key.size(),
+                     data + size + TAG_SIZE, IV_SIZE);
+    enc.EncryptAndAuthenticate(data + size + TAG_SIZE + IV_SIZE,
+                               data + size, TAG_SIZE,
+                               data + size + TAG_SIZE, IV_SIZE,
+                               data, size,
+                               data + size + TAG_SIZE + IV_SIZE,
+                               payload.size());
+
+    Stats::add("groups.sealed");
+
+    return frame;
+}
+
+GroupKey Groups::generate(const QByteArray &id_room)
+{
+    GroupKey key;
+    key.id_room = id_room;
+    key.epoch = ++counter;
+    key.key.resize(KEY_SIZE);
+
+    getRng().GenerateBlock(key.key.data(), key.key.size());
+
+    return key;
+}
+
+AutoSeededRandomPool &Groups::getRng()
+{
+    if (!rngs.hasLocalData())
+    {
+        rngs.setLocalData(new AutoSeededRandomPool);
+    }
+
+    return *rngs.localData();
+}
@@ -0,0 +1,50 @@
+#ifndef GROUPS_H
+#define GROUPS_H
+
+#include "packet.h"
+
+#include <QHash>
+#include <QReadWriteLock>
+#include <QThreadStorage>
+#include <QVector>
+
+namespace CryptoPP
+{
+class AutoSeededRandomPool;
+}
+
+class Groups
+{
+public:
+    static void prepare();
+
+    static bool isEnabled();
+
+    static GroupKey get(const QByteArray &);
+    static QVector<GroupKey> getValid(const QByteArray &);
+    static GroupKey rotate(const QByteArray &);
+    static void publish(const QByteArray &, quint32);
+
+    static QByteArray seal(const QByteArray &, PacketType, const QByteArray &, bool);
+
+private:
+    struct Room
+    {
+        GroupKey current;
+        GroupKey pending;
+    };
+
+    static bool enabled;
+
+    static QReadWriteLock lock;
+    static QHash<QByteArray, Room> rooms;
+    static quint32 counter;
+
+    static QThreadStorage<CryptoPP::AutoSeededRandomPool *> rngs;
+
+    static CryptoPP::AutoSeededRandomPool &getRng();
+
+    static GroupKey generate(const QByteArray &);
+};
+
+#endif // GROUPS_H
@@ -0,0 +1,128 @@
+#include "keypool.h"
+#include "server.h"
+#include "stats.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QThread>
+
+namespace
+{
+class Producer : public QThread
+{
+public:
+    explicit Producer(void (*f)()) : f(f)
+    {
+    }
+
+protected:
+    void run() override
+    {
+        f();
+    }
+
+private:
+    void (*f)();
+};
+}
+
+QMutex KeyPool::mutex;
+QWaitCondition KeyPool::refill;
+QQueue<EphemeralKey> KeyPool::reservoir;
+int KeyPool::capacity = 0;
+int KeyPool::watermark = 0;
+bool KeyPool::stopping = false;
+
+void KeyPool::prepare()
+{
+    auto &settings = Server::getSettings();
+
+    capacity = settings.value("KeyPoolSize", 32).toInt();
+    watermark = qBound(0, settings.value("KeyPoolWatermark", capacity / 4).toInt(), capacity - 1);
+
+    if (capacity < 1)
+    {
+        return;
+    }
+
+    auto thread = new Producer(&KeyPool::produce);
+    thread->setPriority(QThread::LowPriority);
+    thread->start();
+
+    QObject::connect(qApp, &QCoreApplication::aboutToQuit, [ = ]
+    {
+        mutex.lock();
+        stopping = true;
+        refill.wakeAll();
+        mutex.unlock();
+
+        thread->wait();
+        delete thread;
+    });
+}
+
+bool KeyPool::take(EphemeralKey &key)
+{
+    QMutexLocker locker(&mutex);
+
+    if (reservoir.isEmpty())
+    {
+        if (capacity > 0)
+        {
+            Stats::add("keypool.misses");
+        }
+
+        return false;
+    }
+
+    key = reservoir.dequeue();
+
+    Stats::set("keypool.depth", reservoir.size());
+
+    if (reservoir.size() <= watermark)
+    {
+        refill.wakeOne();
+    }
+
+    return true;
+}
+
+void KeyPool::produce()
+{
+    QMutexLocker locker(&mutex);
+
+    while (!stopping)
+    {
+        if (reservoir.size() > watermark)
+        {
+            refill.wait(&mutex);
+            continue;
+        }
+
+        while (!stopping && reservoir.size() < capacity)
+        {
+            locker.unlock();
+
+            QElapsedTimer timer;
+            timer.start();
+
+            auto key = Crypto::generate();
+
+            Stats::record("keypool.generate_us", timer.nsecsElapsed() / 1000);
+
+            locker.relock();
+
+            if (key.signature.isEmpty())
+            {
+                Stats::add("keypool.failures");
+                refill.wait(&mutex, 1000);
+                break;
+            }
+
+            reservoir.enqueue(key);
+
+            Stats::add("keypool.produced");
+            Stats::set("keypool.depth", reservoir.size());
+        }
+    }
+}
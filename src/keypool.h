@@ -0,0 +1,29 @@
+#ifndef KEYPOOL_H
+#define KEYPOOL_H
+
+#include "crypto.h"
+
+#include <QMutex>
+#include <QQueue>
+#include <QWaitCondition>
+
+class KeyPool
+{
+public:
+    static void prepare();
+
+    static bool take(EphemeralKey &);
+
+private:
+    static QMutex mutex;
+    static QWaitCondition refill;
+    static QQueue<EphemeralKey> reservoir;
+
+    static int capacity;
+    static int watermark;
+    static bool stopping;
+
+    static void produce();
+};
+
+#endif // KEYPOOL_H
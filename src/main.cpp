@@ -1,4 +1,8 @@
-#include "packet.h"
+#include "archive.h"
+#include "crypto.h"
+#include "delivery.h"
+#include "parser.h"
+#include "registry.h"
 #include "server.h"
 
 #include <QCoreApplication>
@@ -17,24 +21,23 @@ int main(int argc, char *argv[])
 {
     signal(SIGINT, signalHandler);
 
-    qRegisterMetaTypeStreamOperators<ServerKeyExchange>("ServerKeyExchange");
-    qRegisterMetaTypeStreamOperators<ClientKeyExchange>("ClientKeyExchange");
-    qRegisterMetaTypeStreamOperators<RtAuthorization>("RtAuthorization");
-    qRegisterMetaTypeStreamOperators<ReAuthorization>("ReAuthorization");
-    qRegisterMetaTypeStreamOperators<Room>("Room");
-    qRegisterMetaTypeStreamOperators<Established>("Established");
-    qRegisterMetaTypeStreamOperators<Synchronize>("Synchronize");
-    qRegisterMetaTypeStreamOperators<UserState>("UserState");
-    qRegisterMetaTypeStreamOperators<Message>("Message");
-    qRegisterMetaTypeStreamOperators<RtRoom>("RtRoom");
-    qRegisterMetaTypeStreamOperators<ReRoom>("ReRoom");
-    qRegisterMetaTypeStreamOperators<RtUpload>("RtUpload");
-    qRegisterMetaTypeStreamOperators<ReUpload>("ReUpload");
-    qRegisterMetaTypeStreamOperators<Upload>("Upload");
-    qRegisterMetaTypeStreamOperators<UploadState>("UploadState");
-    qRegisterMetaTypeStreamOperators<Ping>("Ping");
-
     QCoreApplication a(argc, argv);
+
+    if (a.arguments().contains("--benchmark"))
+    {
+        Crypto::benchmark();
+        Parser::benchmark();
+        Delivery::benchmark();
+        Registry::benchmark();
+        return EXIT_SUCCESS;
+    }
+
+    if (a.arguments().contains("--benchmark-archive"))
+    {
+        Archive::benchmark();
+        return EXIT_SUCCESS;
+    }
+
     Server();
     return QCoreApplication::exec();
 }
@@ -1,12 +1,214 @@
 #include "packet.h"
 
-#include <QDataStream>
+#include <QtEndian>
+
+#include <cstring>
+
+PacketStream::PacketStream(QByteArray *data, QIODevice::OpenMode mode, quint8 version)
+    : QDataStream(data, mode)
+    , version(version)
+{
+}
+
+PacketStream::PacketStream(const QByteArray &data, quint8 version)
+    : QDataStream(data)
+    , version(version)
+{
+}
+
+quint8 PacketStream::protocol() const
+{
+    return version;
+}
+
+void PacketStream::writeText(const QString &value)
+{
+    if (!isUtf8Text(version))
+    {
+        *this << value;
+        return;
+    }
+
+    if (value.isNull())
+    {
+        *this << quint32(0xFFFFFFFF);
+        return;
+    }
+
+    auto utf8 = value.toUtf8();
+
+    *this << quint32(utf8.size());
+    writeRawData(utf8.constData(), utf8.size());
+}
+
+void PacketStream::readText(QString &value)
+{
+    if (!isUtf8Text(version))
+    {
+        *this >> value;
+        return;
+    }
+
+    value = QString();
+
+    quint32 length;
+    *this >> length;
+
+    if (status() != Ok || length == 0xFFFFFFFF)
+    {
+        return;
+    }
+
+    if (length > quint32(device()->bytesAvailable()))
+    {
+        setStatus(ReadPastEnd);
+        return;
+    }
+
+    QByteArray utf8(int(length), Qt::Uninitialized);
+
+    if (readRawData(utf8.data(), utf8.size()) != utf8.size())
+    {
+        setStatus(ReadPastEnd);
+        return;
+    }
+
+    if (!isValidUtf8(utf8.constData(), utf8.size()))
+    {
+        setStatus(ReadCorruptData);
+        return;
+    }
+
+    value = QString::fromUtf8(utf8);
+}
+
+bool isUtf8Text(quint8 version)
+{
+    return version >= 1;
+}
+
+bool isExtendedFraming(quint8 version)
+{
+    return version >= 2;
+}
+
+bool hasTrafficKeys(quint8 version)
+{
+    return version >= 3;
+}
+
+bool hasAeadChoice(quint8 version)
+{
+    return version >= 4;
+}
+
+int encodeVarint(quint32 value, char *out)
+{
+    int size = 0;
+
+    while (value >= 0x80)
+    {
+        out[size++] = char((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+
+    out[size++] = char(value);
+
+    return size;
+}
+
+bool isValidUtf8(const char *data, int size)
+{
+    auto bytes = reinterpret_cast<const quint8 *>(data);
+
+    int i = 0;
+
+    while (i < size)
+    {
+        if (size - i >= 8)
+        {
+            quint64 block;
+            memcpy(&block, bytes + i, sizeof(block));
+
+            if ((block & Q_UINT64_C(0x8080808080808080)) == 0)
+            {
+                i += 8;
+                continue;
+            }
+        }
+
+        auto c = bytes[i];
+
+        if (c < 0x80)
+        {
+            i++;
+            continue;
+        }
+
+        int length;
+        quint32 min;
+        quint32 cp;
+
+        if ((c & 0xE0) == 0xC0)
+        {
+            length = 2;
+            min = 0x80;
+            cp = c & 0x1F;
+        }
+        else if ((c & 0xF0) == 0xE0)
+        {
+            length = 3;
+            min = 0x800;
+            cp = c & 0x0F;
+        }
+        else if ((c & 0xF8) == 0xF0)
+        {
+            length = 4;
+            min = 0x10000;
+            cp = c & 0x07;
+        }
+        else
+        {
+            return false;
+        }
+
+        if (size - i < length)
+        {
+            return false;
+        }
+
+        for (int j = 1; j < length; j++)
+        {
+            if ((bytes[i + j] & 0xC0) != 0x80)
+            {
+                return false;
+            }
+
+            cp = (cp << 6) | (bytes[i + j] & 0x3F);
+        }
+
+        if (cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        {
+            return false;
+        }
+
+        i += length;
+    }
+
+    return true;
+}
 
 QDataStream &operator<<(QDataStream &out, const ServerKeyExchange &d)
 {
     out << d.public_key[0]
         << d.public_key[1]
-        << d.signature;
+        << d.signature
+        << d.kem
+        << d.sig
+        << d.version
+        << d.rekey_packets
+        << d.rekey_bytes
+        << d.aeads;
     return out;
 };
 
@@ -14,19 +216,61 @@ QDataStream &operator>>(QDataStream &in, ServerKeyExchange &d)
 {
     in >> d.public_key[0]
        >> d.public_key[1]
-       >> d.signature;
+       >> d.signature
+       >> d.kem
+       >> d.sig;
+
+    d.version = 0;
+    d.rekey_packets = 0;
+    d.rekey_bytes = 0;
+
+    if (!in.atEnd())
+    {
+        in >> d.version;
+    }
+
+    if (!in.atEnd())
+    {
+        in >> d.rekey_packets
+           >> d.rekey_bytes;
+    }
+
+    d.aeads.clear();
+
+    if (!in.atEnd())
+    {
+        in >> d.aeads;
+    }
+
     return in;
 }
 
 QDataStream &operator<<(QDataStream &out, const ClientKeyExchange &d)
 {
-    out << d.ciphertext;
+    out << d.ciphertext
+        << d.version
+        << d.aead;
     return out;
 }
 
 QDataStream &operator>>(QDataStream &in, ClientKeyExchange &d)
 {
     in >> d.ciphertext;
+
+    d.version = 0;
+
+    if (!in.atEnd())
+    {
+        in >> d.version;
+    }
+
+    d.aead.clear();
+
+    if (!in.atEnd())
+    {
+        in >> d.aead;
+    }
+
     return in;
 }
 
@@ -60,33 +304,63 @@ QDataStream &operator>>(QDataStream &in, ReAuthorization &d)
     return in;
 }
 
-QDataStream &operator<<(QDataStream &out, const Room &d)
+PacketStream &operator<<(PacketStream &out, const Room &d)
 {
-    out << d.id
-        << d.name;
+    out << d.id;
+    out.writeText(d.name);
     return out;
 }
 
-QDataStream &operator>>(QDataStream &in, Room &d)
+PacketStream &operator>>(PacketStream &in, Room &d)
 {
-    in >> d.id
-       >> d.name;
+    in >> d.id;
+    in.readText(d.name);
     return in;
 }
 
-QDataStream &operator<<(QDataStream &out, const Established &d)
+PacketStream &operator<<(PacketStream &out, const Established &d)
 {
-    out << d.name
-        << d.motd
-        << d.rooms;
+    out.writeText(d.name);
+    out.writeText(d.motd);
+    out << quint32(d.rooms.size());
+
+    for (const auto &room : d.rooms)
+    {
+        out << room;
+    }
+
+    if (isExtendedFraming(out.protocol()))
+    {
+        out << d.frame_limit;
+    }
+
     return out;
 }
 
-QDataStream &operator>>(QDataStream &in, Established &d)
+PacketStream &operator>>(PacketStream &in, Established &d)
 {
-    in >> d.name
-       >> d.motd
-       >> d.rooms;
+    in.readText(d.name);
+    in.readText(d.motd);
+
+    quint32 count;
+    in >> count;
+
+    d.rooms.clear();
+
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; i++)
+    {
+        Room room;
+        in >> room;
+        d.rooms.append(room);
+    }
+
+    d.frame_limit = 0xFFFF;
+
+    if (isExtendedFraming(in.protocol()))
+    {
+        in >> d.frame_limit;
+    }
+
     return in;
 }
 
@@ -116,21 +390,21 @@ QDataStream &operator>>(QDataStream &in, UserState &d)
     return in;
 }
 
-QDataStream &operator<<(QDataStream &out, const Message &d)
+PacketStream &operator<<(PacketStream &out, const Message &d)
 {
     out << d.timestamp
-        << d.id
-        << d.id_sender
-        << d.content;
+        << d.id;
+    out.writeText(d.id_sender);
+    out.writeText(d.content);
     return out;
 }
 
-QDataStream &operator>>(QDataStream &in, Message &d)
+PacketStream &operator>>(PacketStream &in, Message &d)
 {
     in >> d.timestamp
-       >> d.id
-       >> d.id_sender
-       >> d.content;
+       >> d.id;
+    in.readText(d.id_sender);
+    in.readText(d.content);
     return in;
 }
 
@@ -231,3 +505,321 @@ QDataStream &operator>>(QDataStream &in, Ping &d)
     in >> d.timestamp;
     return in;
 }
+
+QDataStream &operator<<(QDataStream &out, const SessionTicket &d)
+{
+    out << d.ticket
+        << d.lifetime;
+    return out;
+}
+
+QDataStream &operator>>(QDataStream &in, SessionTicket &d)
+{
+    in >> d.ticket
+       >> d.lifetime;
+    return in;
+}
+
+QDataStream &operator<<(QDataStream &out, const Resumption &d)
+{
+    out << d.ticket
+        << d.nonce
+        << d.version
+        << d.aead;
+    return out;
+}
+
+QDataStream &operator>>(QDataStream &in, Resumption &d)
+{
+    in >> d.ticket
+       >> d.nonce;
+
+    d.version = 0;
+
+    if (!in.atEnd())
+    {
+        in >> d.version;
+    }
+
+    d.aead.clear();
+
+    if (!in.atEnd())
+    {
+        in >> d.aead;
+    }
+
+    return in;
+}
+
+QDataStream &operator<<(QDataStream &out, const ReResumption &d)
+{
+    out << d.response;
+
+    if (!d.nonce.isEmpty())
+    {
+        out << d.nonce;
+    }
+
+    return out;
+}
+
+QDataStream &operator>>(QDataStream &in, ReResumption &d)
+{
+    in >> d.response;
+
+    d.nonce.clear();
+
+    if (!in.atEnd())
+    {
+        in >> d.nonce;
+    }
+
+    return in;
+}
+
+QDataStream &operator<<(QDataStream &out, const SessionToken &d)
+{
+    out << d.token
+        << d.lifetime;
+    return out;
+}
+
+QDataStream &operator>>(QDataStream &in, SessionToken &d)
+{
+    in >> d.token
+       >> d.lifetime;
+    return in;
+}
+
+QDataStream &operator<<(QDataStream &out, const GroupKey &d)
+{
+    out << d.id_room
+        << d.epoch
+        << d.key;
+    return out;
+}
+
+QDataStream &operator>>(QDataStream &in, GroupKey &d)
+{
+    in >> d.id_room
+       >> d.epoch
+       >> d.key;
+    return in;
+}
+
+PacketReader::PacketReader(const char *data, int size, quint8 version)
+    : data(data)
+    , size(size)
+    , offset(0)
+    , version(version)
+    , valid(true)
+{
+}
+
+bool PacketReader::isValid() const
+{
+    return valid;
+}
+
+quint8 PacketReader::protocol() const
+{
+    return version;
+}
+
+PacketReader &PacketReader::operator>>(qint64 &value)
+{
+    if (!valid || size - offset < int(sizeof(value)))
+    {
+        valid = false;
+        return *this;
+    }
+
+    value = qFromBigEndian<qint64>(data + offset);
+    offset += sizeof(value);
+
+    return *this;
+}
+
+PacketReader &PacketReader::operator>>(QByteArray &value)
+{
+    int begin;
+    int length;
+
+    if (!field(begin, length))
+    {
+        value = QByteArray();
+        return *this;
+    }
+
+    value = length < 0
+            ? QByteArray()
+            : QByteArray::fromRawData(data + begin, length);
+
+    return *this;
+}
+
+PacketReader &PacketReader::operator>>(QString &value)
+{
+    int begin;
+    int length;
+
+    if (!field(begin, length))
+    {
+        value = QString();
+        return *this;
+    }
+
+    if (length < 0)
+    {
+        value = QString();
+        return *this;
+    }
+
+    if (isUtf8Text(version))
+    {
+        if (!isValidUtf8(data + begin, length))
+        {
+            valid = false;
+            return *this;
+        }
+
+        value = QString::fromUtf8(data + begin, length);
+        return *this;
+    }
+
+    if (length % 2 != 0)
+    {
+        valid = false;
+        return *this;
+    }
+
+    value.resize(length / 2);
+
+    auto chars = value.data();
+
+    for (int i = 0; i < value.size(); i++)
+    {
+        chars[i] = QChar(qFromBigEndian<quint16>(data + begin + i * 2));
+    }
+
+    return *this;
+}
+
+PacketReader &PacketReader::rawString(QByteArray &value)
+{
+    auto begin = offset;
+
+    int start;
+    int length;
+
+    if (!field(start, length)
+            || (length > 0 && (isUtf8Text(version)
+                               ? !isValidUtf8(data + start, length)
+                               : length % 2 != 0)))
+    {
+        valid = false;
+        value = QByteArray();
+        return *this;
+    }
+
+    value = QByteArray::fromRawData(data + begin, offset - begin);
+
+    return *this;
+}
+
+bool PacketReader::field(int &begin, int &length)
+{
+    if (!valid || size - offset < int(sizeof(quint32)))
+    {
+        valid = false;
+        return false;
+    }
+
+    auto prefix = qFromBigEndian<quint32>(data + offset);
+    offset += sizeof(quint32);
+
+    if (prefix == 0xFFFFFFFF)
+    {
+        begin = offset;
+        length = -1;
+        return true;
+    }
+
+    if (prefix > quint32(size - offset))
+    {
+        valid = false;
+        return false;
+    }
+
+    begin = offset;
+    length = int(prefix);
+    offset += length;
+
+    return true;
+}
+
+PacketReader &operator>>(PacketReader &in, SynchronizeView &d)
+{
+    in >> d.id_message;
+    return in;
+}
+
+void SynchronizeView::detach()
+{
+    id_message = QByteArray(id_message.constData(), id_message.size());
+}
+
+QString MessageView::text() const
+{
+    QString value;
+    PacketReader(content.constData(), content.size(), version) >> value;
+    return value;
+}
+
+void MessageView::detach()
+{
+    id = QByteArray(id.constData(), id.size());
+    content = QByteArray(content.constData(), content.size());
+}
+
+PacketStream &operator<<(PacketStream &out, const MessageView &d)
+{
+    out << d.timestamp
+        << d.id;
+    out.writeText(d.id_sender);
+
+    if (isUtf8Text(out.protocol()) == isUtf8Text(d.version))
+    {
+        out.writeRawData(d.content.constData(), d.content.size());
+    }
+    else
+    {
+        out.writeText(d.text());
+    }
+
+    return out;
+}
+
+PacketReader &operator>>(PacketReader &in, MessageView &d)
+{
+    d.version = in.protocol();
+
+    in >> d.timestamp
+       >> d.id
+       >> d.id_sender;
+    in.rawString(d.content);
+    return in;
+}
+
+PacketReader &operator>>(PacketReader &in, UploadView &d)
+{
+    in >> d.id
+       >> d.chunkdata;
+    return in;
+}
+
+PacketReader &operator>>(PacketReader &in, Ping &d)
+{
+    in >> d.timestamp;
+    return in;
+}
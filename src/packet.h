@@ -1,9 +1,34 @@
 #ifndef PACKET_H
 #define PACKET_H
 
-#include <QMetaType>
+#include <QDataStream>
+#include <QList>
 #include <QVector>
 
+constexpr quint8 PROTOCOL_VERSION = 4;
+
+class PacketStream : public QDataStream
+{
+public:
+    explicit PacketStream(QByteArray *, QIODevice::OpenMode, quint8);
+    explicit PacketStream(const QByteArray &, quint8);
+
+    quint8 protocol() const;
+
+    void writeText(const QString &);
+    void readText(QString &);
+
+private:
+    quint8 version;
+};
+
+bool isUtf8Text(quint8);
+bool isExtendedFraming(quint8);
+bool hasTrafficKeys(quint8);
+bool hasAeadChoice(quint8);
+int encodeVarint(quint32, char *);
+bool isValidUtf8(const char *, int);
+
 enum class PacketType
 {
     Handshake,
@@ -20,13 +45,26 @@ enum class PacketType
     Upload,
     UploadState,
     Ping,
-    Pong
+    Pong,
+    SessionTicket,
+    Resumption,
+    ReResumption,
+    SessionToken,
+    GroupKey,
+    GroupMessage,
+    Count
 };
 
 struct ServerKeyExchange
 {
     QVector<quint8> public_key[2];
     QVector<quint8> signature;
+    QByteArray kem;
+    QByteArray sig;
+    quint8 version;
+    quint64 rekey_packets;
+    quint64 rekey_bytes;
+    QList<QByteArray> aeads;
 };
 QDataStream &operator<<(QDataStream &, const ServerKeyExchange &);
 QDataStream &operator>>(QDataStream &, ServerKeyExchange &);
@@ -34,6 +72,8 @@ QDataStream &operator>>(QDataStream &, ServerKeyExchange &);
 struct ClientKeyExchange
 {
     QVector<quint8> ciphertext;
+    quint8 version;
+    QByteArray aead;
 };
 QDataStream &operator<<(QDataStream &, const ClientKeyExchange &);
 QDataStream &operator>>(QDataStream &, ClientKeyExchange &);
@@ -43,7 +83,9 @@ struct RtAuthorization
     enum Request
     {
         Signin,
-        Signup
+        Signup,
+        Token,
+        Revoke
     };
     QByteArray username;
     QByteArray password;
@@ -64,7 +106,9 @@ struct ReAuthorization
         NoError,
         InvalidUsername,
         InvalidPassword,
-        UserExists
+        UserExists,
+        ServerBusy,
+        InvalidToken
     };
     Response response;
     Error error;
@@ -77,17 +121,18 @@ struct Room
     QByteArray id;
     QString name;
 };
-QDataStream &operator<<(QDataStream &, const Room &);
-QDataStream &operator>>(QDataStream &, Room &);
+PacketStream &operator<<(PacketStream &, const Room &);
+PacketStream &operator>>(PacketStream &, Room &);
 
 struct Established
 {
     QString name;
     QString motd;
     QVector<Room> rooms;
+    quint32 frame_limit;
 };
-QDataStream &operator<<(QDataStream &, const Established &);
-QDataStream &operator>>(QDataStream &, Established &);
+PacketStream &operator<<(PacketStream &, const Established &);
+PacketStream &operator>>(PacketStream &, Established &);
 
 struct Synchronize
 {
@@ -116,15 +161,16 @@ struct Message
     QString id_sender;
     QString content;
 };
-QDataStream &operator<<(QDataStream &, const Message &);
-QDataStream &operator>>(QDataStream &, Message &);
+PacketStream &operator<<(PacketStream &, const Message &);
+PacketStream &operator>>(PacketStream &, Message &);
 
 struct RtRoom
 {
     enum Request
     {
         Join,
-        Leave
+        Leave,
+        JoinGroup
     };
     QByteArray id;
     Request request;
@@ -209,22 +255,107 @@ struct Ping
 QDataStream &operator<<(QDataStream &, const Ping &);
 QDataStream &operator>>(QDataStream &, Ping &);
 
-Q_DECLARE_METATYPE(PacketType)
-Q_DECLARE_METATYPE(ServerKeyExchange)
-Q_DECLARE_METATYPE(ClientKeyExchange)
-Q_DECLARE_METATYPE(RtAuthorization)
-Q_DECLARE_METATYPE(ReAuthorization)
-Q_DECLARE_METATYPE(Room)
-Q_DECLARE_METATYPE(Established)
-Q_DECLARE_METATYPE(Synchronize)
-Q_DECLARE_METATYPE(UserState)
-Q_DECLARE_METATYPE(Message)
-Q_DECLARE_METATYPE(RtRoom)
-Q_DECLARE_METATYPE(ReRoom)
-Q_DECLARE_METATYPE(RtUpload)
-Q_DECLARE_METATYPE(ReUpload)
-Q_DECLARE_METATYPE(Upload)
-Q_DECLARE_METATYPE(UploadState)
-Q_DECLARE_METATYPE(Ping)
+struct SessionTicket
+{
+    QByteArray ticket;
+    qint64 lifetime;
+};
+QDataStream &operator<<(QDataStream &, const SessionTicket &);
+QDataStream &operator>>(QDataStream &, SessionTicket &);
+
+struct Resumption
+{
+    QByteArray ticket;
+    QByteArray nonce;
+    quint8 version;
+    QByteArray aead;
+};
+QDataStream &operator<<(QDataStream &, const Resumption &);
+QDataStream &operator>>(QDataStream &, Resumption &);
+
+struct ReResumption
+{
+    enum Response
+    {
+        Resumed,
+        Rejected
+    };
+    Response response;
+    QByteArray nonce;
+};
+QDataStream &operator<<(QDataStream &, const ReResumption &);
+QDataStream &operator>>(QDataStream &, ReResumption &);
+
+struct SessionToken
+{
+    QByteArray token;
+    qint64 lifetime;
+};
+QDataStream &operator<<(QDataStream &, const SessionToken &);
+QDataStream &operator>>(QDataStream &, SessionToken &);
+
+struct GroupKey
+{
+    QByteArray id_room;
+    quint32 epoch;
+    QVector<quint8> key;
+};
+QDataStream &operator<<(QDataStream &, const GroupKey &);
+QDataStream &operator>>(QDataStream &, GroupKey &);
+
+class PacketReader
+{
+public:
+    explicit PacketReader(const char *, int, quint8);
+
+    bool isValid() const;
+    quint8 protocol() const;
+
+    PacketReader &operator>>(qint64 &);
+    PacketReader &operator>>(QByteArray &);
+    PacketReader &operator>>(QString &);
+
+    PacketReader &rawString(QByteArray &);
+
+private:
+    const char *data;
+    int size;
+    int offset;
+    quint8 version;
+    bool valid;
+
+    bool field(int &, int &);
+};
+
+struct SynchronizeView
+{
+    QByteArray id_message;
+
+    void detach();
+};
+PacketReader &operator>>(PacketReader &, SynchronizeView &);
+
+struct MessageView
+{
+    qint64 timestamp;
+    QByteArray id;
+    QString id_sender;
+    QByteArray content;
+    quint8 version;
+
+    QString text() const;
+    void detach();
+};
+PacketStream &operator<<(PacketStream &, const MessageView &);
+PacketReader &operator>>(PacketReader &, MessageView &);
+
+struct UploadView
+{
+    QByteArray id;
+    QByteArray chunkdata;
+};
+PacketReader &operator>>(PacketReader &, UploadView &);
+
+PacketReader &operator>>(PacketReader &, Ping &);
 
 #endif // PACKET_H
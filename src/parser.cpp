@@ -0,0 +1,170 @@
+#include "parser.h"
+
+#include <QtDebug>
+#include <QBuffer>
+#include <QElapsedTimer>
+#include <QtEndian>
+
+static constexpr int HEADER_SIZE = 3;
+static constexpr int VARINT_SIZE = 5;
+
+Parser::Parser()
+    : head(0)
+    , error(false)
+{
+}
+
+void Parser::benchmark()
+{
+    static const int sizes[] = { 16, 256, 4096, 0xFFFF };
+
+    for (auto size : sizes)
+    {
+        QByteArray frame(HEADER_SIZE + size, 0);
+        qToBigEndian(quint16(size), frame.data() + 1);
+
+        auto count = qMax((64 << 20) / frame.size(), 1);
+
+        QByteArray data;
+        data.reserve(count * frame.size());
+
+        for (int i = 0; i < count; i++)
+        {
+            data.append(frame);
+        }
+
+        QBuffer device(&data);
+        device.open(QIODevice::ReadOnly);
+
+        Parser parser;
+        Framing framing = { 0, 0, false, 0xFFFF };
+        Frame f;
+        qint64 frames = 0;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        while (parser.fill(&device, 0x10000) > 0)
+        {
+            while (parser.next(f, framing))
+            {
+                frames++;
+            }
+        }
+
+        auto elapsed = timer.nsecsElapsed();
+
+        qInfo().noquote() << QString("Parser, %1-byte frames: %2 frames/s, %3 MiB/s")
+                          .arg(size)
+                          .arg(frames * 1e9 / elapsed, 0, 'f', 0)
+                          .arg(data.size() * 1e9 / elapsed / (1 << 20), 0, 'f', 1);
+    }
+}
+
+qint64 Parser::fill(QIODevice *device, qint64 limit)
+{
+    if (buffer.capacity() - buffer.size() < limit)
+    {
+        compact();
+        buffer.reserve(buffer.size() + int(limit));
+    }
+
+    auto size = buffer.size();
+    buffer.resize(size + int(limit));
+
+    auto read = device->read(buffer.data() + size, limit);
+
+    buffer.resize(size + int(qMax(read, qint64(0))));
+
+    return read;
+}
+
+bool Parser::next(Frame &frame, const Framing &framing)
+{
+    auto available = buffer.size() - head;
+
+    if (error || available < (framing.extended ? 2 : HEADER_SIZE))
+    {
+        return false;
+    }
+
+    auto data = buffer.data() + head;
+
+    int header;
+    qint64 length;
+    qint64 crypto;
+
+    if (!framing.extended)
+    {
+        header = HEADER_SIZE;
+        length = qFromBigEndian<quint16>(data + 1);
+    }
+    else
+    {
+        header = 1;
+        length = 0;
+
+        for (int shift = 0;; shift += 7)
+        {
+            if (header > VARINT_SIZE)
+            {
+                error = true;
+                return false;
+            }
+
+            if (header == available)
+            {
+                return false;
+            }
+
+            auto byte = quint8(data[header++]);
+            length |= qint64(byte & 0x7F) << shift;
+
+            if ((byte & 0x80) == 0)
+            {
+                break;
+            }
+        }
+    }
+
+    crypto = length > 0 ? framing.tag + framing.iv : 0;
+
+    if (length > framing.maximum)
+    {
+        error = true;
+        return false;
+    }
+
+    auto size = header + crypto + length;
+
+    if (available < size)
+    {
+        return false;
+    }
+
+    frame.type = quint8(data[0]);
+    frame.crypto = crypto > 0 ? data + header : nullptr;
+    frame.payload = data + header + crypto;
+    frame.length = int(length);
+    frame.size = int(size);
+
+    head += frame.size;
+
+    return true;
+}
+
+bool Parser::hasError() const
+{
+    return error;
+}
+
+void Parser::compact()
+{
+    if (head == 0)
+    {
+        return;
+    }
+
+    buffer.remove(0, head);
+    head = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <QByteArray>
+
+class QIODevice;
+class Parser
+{
+public:
+    struct Framing
+    {
+        int tag;
+        int iv;
+        bool extended;
+        int maximum;
+    };
+
+    struct Frame
+    {
+        quint8 type;
+        char *crypto;
+        char *payload;
+        int length;
+        int size;
+    };
+
+    explicit Parser();
+
+    static void benchmark();
+
+    qint64 fill(QIODevice *, qint64);
+    bool next(Frame &, const Framing &);
+
+    bool hasError() const;
+
+private:
+    QByteArray buffer;
+    int head;
+    bool error;
+
+    void compact();
+};
+
+#endif // PARSER_H
@@ -0,0 +1,181 @@
+#include "registry.h"
+
+#include <QtDebug>
+#include <QAtomicInteger>
+#include <QElapsedTimer>
+#include <QThread>
+
+static constexpr int BENCHMARK_MS = 1000;
+static constexpr int BENCHMARK_ROOM = 64;
+static constexpr int BENCHMARK_READS = 16;
+
+void Registry::benchmark()
+{
+    static const int counts[] = { 1, 2, 4, 8 };
+    static const QByteArray room = "benchmark";
+
+    for (auto count : counts)
+    {
+        Registry registry;
+
+        for (int i = 0; i < BENCHMARK_ROOM; i++)
+        {
+            registry.insert(room, Member
+            {
+                reinterpret_cast<Client *>(quintptr(i + 1)),
+                quint64(i + 1),
+                QByteArray::number(i),
+                0,
+                false
+            });
+        }
+
+        QAtomicInteger<qint64> reads(0);
+        QAtomicInteger<qint64> writes(0);
+        QAtomicInteger<qint64> members(0);
+        QVector<QThread *> threads;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        for (int t = 0; t < count; t++)
+        {
+            threads.append(QThread::create([ =, &registry, &timer, &reads, &writes, &members]
+            {
+                Member self
+                {
+                    reinterpret_cast<Client *>(quintptr(0x10000 + t)),
+                    quint64(0x10000 + t),
+                    "user." + QByteArray::number(t),
+                    0,
+                    false
+                };
+
+                qint64 r = 0;
+                qint64 w = 0;
+                qint64 m = 0;
+
+                while (timer.elapsed() < BENCHMARK_MS)
+                {
+                    for (int i = 0; i < BENCHMARK_READS; i++)
+                    {
+                        m += registry.values(room)->size();
+                        r++;
+                    }
+
+                    registry.insert(room, self);
+                    registry.remove(room, self.client);
+                    registry.insert(self.id, self);
+                    registry.remove(self.id, self.client);
+                    w += 4;
+                }
+
+                reads += r;
+                writes += w;
+                members += m;
+            }));
+        }
+
+        for (auto thread : threads)
+        {
+            thread->start();
+        }
+
+        for (auto thread : threads)
+        {
+            thread->wait();
+            delete thread;
+        }
+
+        auto elapsed = timer.nsecsElapsed();
+
+        qInfo().noquote() << QString("Registry, %1 threads: %2 snapshots/s, %3 updates/s, %4 members/snapshot")
+                          .arg(count)
+                          .arg(reads.load() * 1e9 / elapsed, 0, 'f', 0)
+                          .arg(writes.load() * 1e9 / elapsed, 0, 'f', 0)
+                          .arg(double(members.load()) / qMax(reads.load(), qint64(1)), 0, 'f', 1);
+    }
+}
+
+void Registry::insert(const QByteArray &key, const Member &member)
+{
+    auto &s = shard(key);
+
+    QWriteLocker locker(&s.lock);
+
+    QSharedPointer<QVector<Member>> members(new QVector<Member>);
+
+    if (s.members.contains(key))
+    {
+        *members = *s.members.value(key);
+    }
+
+    members->append(member);
+
+    s.members.insert(key, members);
+}
+
+bool Registry::remove(const QByteArray &key, Client *client)
+{
+    auto &s = shard(key);
+
+    QWriteLocker locker(&s.lock);
+
+    if (!s.members.contains(key))
+    {
+        return false;
+    }
+
+    QSharedPointer<QVector<Member>> members(new QVector<Member>);
+
+    for (const auto &member : *s.members.value(key))
+    {
+        if (member.client != client)
+        {
+            members->append(member);
+        }
+    }
+
+    if (members->isEmpty())
+    {
+        s.members.remove(key);
+        return true;
+    }
+
+    s.members.insert(key, members);
+    return false;
+}
+
+Registry::Snapshot Registry::values(const QByteArray &key) const
+{
+    static const Snapshot empty(new QVector<Member>);
+
+    auto &s = shard(key);
+
+    QReadLocker locker(&s.lock);
+
+    return s.members.value(key, empty);
+}
+
+bool Registry::contains(const QByteArray &key, Client *client) const
+{
+    for (const auto &member : *values(key))
+    {
+        if (member.client == client)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+Registry::Shard &Registry::shard(const QByteArray &key)
+{
+    return shards[qHash(key) % SHARDS];
+}
+
+const Registry::Shard &Registry::shard(const QByteArray &key) const
+{
+    return shards[qHash(key) % SHARDS];
+}
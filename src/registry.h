@@ -0,0 +1,47 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <QHash>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <QVector>
+
+class Client;
+class Registry
+{
+public:
+    struct Member
+    {
+        Client *client;
+        quint64 serial;
+        QByteArray id;
+        quint8 version;
+        bool group;
+    };
+
+    using Snapshot = QSharedPointer<const QVector<Member>>;
+
+    static void benchmark();
+
+    void insert(const QByteArray &, const Member &);
+    bool remove(const QByteArray &, Client *);
+
+    Snapshot values(const QByteArray &) const;
+    bool contains(const QByteArray &, Client *) const;
+
+private:
+    static constexpr int SHARDS = 64;
+
+    struct Shard
+    {
+        mutable QReadWriteLock lock;
+        QHash<QByteArray, Snapshot> members;
+    };
+
+    Shard shards[SHARDS];
+
+    Shard &shard(const QByteArray &);
+    const Shard &shard(const QByteArray &) const;
+};
+
+#endif // REGISTRY_H
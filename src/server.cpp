@@ -1,7 +1,17 @@
 #include "server.h"
+#include "acceptor.h"
+#include "aead.h"
+#include "archive.h"
+#include "auth.h"
 #include "client.h"
+#include "crypto.h"
 #include "database.h"
+#include "groups.h"
+#include "keypool.h"
+#include "sessions.h"
+#include "stats.h"
 #include "thread.h"
+#include "tickets.h"
 
 #include <QtDebug>
 #include <QCoreApplication>
@@ -18,10 +28,8 @@ using CryptoPP::ArraySource;
 using CryptoPP::HashFilter;
 using CryptoPP::SHA3_512;
 
-#include <oqs/oqs.h>
-
-QMultiHash<QByteArray, Client *> Server::connected;
-QMultiHash<QByteArray, Client *> Server::participants;
+Registry Server::connected;
+Registry Server::participants;
 QByteArray Server::id;
 QVector<quint8> Server::public_key;
 QVector<quint8> Server::secret_key;
@@ -41,6 +49,8 @@ Server::Server()
     initCrypto();
     initDatabase();
 
+    Sessions::prepare();
+
     if (!settings.contains("Name"))
     {
         error("Server name not specified");
@@ -53,31 +63,61 @@ Server::Server()
 
     auto port = settings.value("Port").toInt();
 
-    auto server = new QTcpServer;
-
+    Stats::prepare();
+    Auth::prepare();
+    KeyPool::prepare();
+    Tickets::prepare();
+    Groups::prepare();
+    Aead::prepare();
+    Client::prepare();
     Thread::prepare();
 
-    QObject::connect(server, &QTcpServer::newConnection, [ = ]
+    if (settings.value("ReusePort", false).toBool())
     {
-        auto thread = Thread::get();
+        for (const auto &thread : Thread::all())
+        {
+            auto acceptor = new Acceptor;
+            acceptor->moveToThread(thread);
+
+            bool ok = false;
+
+            QMetaObject::invokeMethod(acceptor, [ = ]
+            {
+                return acceptor->open(port);
+            }, Qt::BlockingQueuedConnection, &ok);
 
-        auto client = new Client;
-        auto socket = server->nextPendingConnection();
+            if (!ok)
+            {
+                error("Unable to listen on a port shared between threads");
+            }
+        }
+    }
+    else
+    {
+        auto server = new QTcpServer;
 
-        socket->setParent(nullptr);
+        QObject::connect(server, &QTcpServer::newConnection, [ = ]
+        {
+            auto thread = Thread::get();
 
-        client->moveToThread(thread);
-        socket->moveToThread(thread);
+            auto client = new Client;
+            auto socket = server->nextPendingConnection();
 
-        Thread::attach(client);
+            socket->setParent(nullptr);
 
-        QMetaObject::invokeMethod(client, "run",
-                                  Q_ARG(QTcpSocket *, socket));
-    });
+            client->moveToThread(thread);
+            socket->moveToThread(thread);
 
-    if (!server->listen(QHostAddress::Any, port))
-    {
-        error(server->errorString());
+            Thread::attach(client);
+
+            QMetaObject::invokeMethod(client, "run",
+                                      Q_ARG(QTcpSocket *, socket));
+        });
+
+        if (!server->listen(QHostAddress::Any, port))
+        {
+            error(server->errorString());
+        }
     }
 
     qInfo() << "Server started listening and is waiting for new connections";
@@ -106,14 +146,14 @@ void Server::error(const QString &reason)
 
 void Server::initCrypto()
 {
-    #if !defined (OQS_ENABLE_KEM_sidh_p751) || !defined (OQS_ENABLE_SIG_picnic2_L5_FS)
-    error("The required post quantum algorithms are not available for use");
-    #endif
+    Crypto::prepare();
+
+    auto sig = Crypto::getSig();
 
-    public_key.resize(OQS_SIG_picnic2_L5_FS_length_public_key);
-    secret_key.resize(OQS_SIG_picnic2_L5_FS_length_secret_key);
+    public_key.resize(sig->length_public_key);
+    secret_key.resize(sig->length_secret_key);
 
-    QFile crt("server.crt");
+    QFile crt(settings.value("Certificate", "server.crt").toString());
 
     if (crt.exists())
     {
@@ -122,6 +162,11 @@ void Server::initCrypto()
             error("Unable to open certificate file");
         }
 
+        if (crt.size() != public_key.size() + secret_key.size())
+        {
+            error("Certificate does not match the signature algorithm");
+        }
+
         crt.read(reinterpret_cast<char *>(public_key.data()), public_key.size());
         crt.read(reinterpret_cast<char *>(secret_key.data()), secret_key.size());
     }
@@ -132,8 +177,9 @@ void Server::initCrypto()
             error("Unable to create certificate file");
         }
 
-        auto rc = OQS_SIG_picnic2_L5_FS_keypair(public_key.data(),
-                                                secret_key.data());
+        auto rc = OQS_SIG_keypair(sig,
+                                  public_key.data(),
+                                  secret_key.data());
 
         if (rc != OQS_SUCCESS)
         {
@@ -214,8 +260,18 @@ void Server::initDatabase()
                            "USERNAME TEXT  NOT NULL UNIQUE,"
                            "DERIVED  BYTEA NOT NULL UNIQUE,"
                            "SALT     BYTEA NOT NULL UNIQUE"
+                           ")")
+            || !query.exec("CREATE TABLE IF NOT EXISTS SESSIONS"
+                           "("
+                           "SELECTOR BYTEA  NOT NULL UNIQUE,"
+                           "USERNAME TEXT   NOT NULL,"
+                           "VERIFIER BYTEA  NOT NULL,"
+                           "EXPIRES  BIGINT NOT NULL"
                            ")"))
     {
         error(query.lastError().text());
     }
+
+    Database::prepare();
+    Archive::prepare();
 }
@@ -1,10 +1,10 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-#include <QMultiHash>
+#include "registry.h"
+
 #include <QSettings>
 
-class Client;
 class Server
 {
 public:
@@ -15,8 +15,8 @@ public:
 
     static QSettings &getSettings();
 
-    static QMultiHash<QByteArray, Client *> connected;
-    static QMultiHash<QByteArray, Client *> participants;
+    static Registry connected;
+    static Registry participants;
 
     [[ noreturn ]] static void error(const QString &);
 
@@ -0,0 +1,249 @@
+#include "sessions.h"
+#include "crypto.h"
+#include "database.h"
+#include "server.h"
+#include "stats.h"
+
+#include <QDateTime>
+#include <QSqlError>
+#include <QSqlQuery>
+
+#include <limits>
+
+#include <cryptopp/hmac.h>
+#include <cryptopp/misc.h>
+#include <cryptopp/osrng.h>
+#include <cryptopp/sha3.h>
+using CryptoPP::AutoSeededRandomPool;
+using CryptoPP::HMAC;
+using CryptoPP::SHA3_256;
+using CryptoPP::VerifyBufsEqual;
+
+static constexpr int SELECTOR_SIZE = 16;
+static constexpr int VALIDATOR_SIZE = 32;
+static constexpr int CACHE_LIMIT = 65536;
+
+QMutex Sessions::mutex;
+QHash<QByteArray, Sessions::Entry> Sessions::cache;
+QVector<quint8> Sessions::key;
+quint64 Sessions::generation = 0;
+QHash<QByteArray, quint64> Sessions::revoked;
+QMap<quint64, int> Sessions::readers;
+qint64 Sessions::lifetime = 0;
+qint64 Sessions::cacheTime = 0;
+
+void Sessions::prepare()
+{
+    auto &settings = Server::getSettings();
+
+    lifetime = settings.value("SessionLifetime", 2592000).toLongLong();
+    cacheTime = settings.value("SessionCacheTime", 60).toLongLong();
+
+    key = Crypto::derive(Server::getSecretKey(), "neutron session");
+
+    QSqlQuery query;
+    query.prepare("DELETE FROM SESSIONS"
+                  " WHERE EXPIRES < ?");
+    query.addBindValue(QDateTime::currentSecsSinceEpoch());
+
+    if (!query.exec())
+    {
+        Server::error(query.lastError().text());
+    }
+}
+
+qint64 Sessions::getLifetime()
+{
+    return lifetime;
+}
+
+QByteArray Sessions::issue(const QByteArray &username)
+{
+    if (lifetime < 1)
+    {
+        return {};
+    }
+
+    QByteArray token(SELECTOR_SIZE + VALIDATOR_SIZE, 0);
+
+    AutoSeededRandomPool rng;
+    rng.GenerateBlock(reinterpret_cast<quint8 *>(token.data()), token.size());
+
+    Database::Result result;
+    Database::exec("INSERT INTO SESSIONS (SELECTOR, USERNAME, VERIFIER, EXPIRES)"
+                   " VALUES (?, ?, ?, ?)",
+    {
+        token.left(SELECTOR_SIZE),
+        username,
+        hash(token.mid(SELECTOR_SIZE)),
+        QDateTime::currentSecsSinceEpoch() + lifetime
+    }, result);
+
+    if (!result.ok)
+    {
+        Server::error(result.error);
+    }
+
+    return token;
+}
+
+bool Sessions::verify(const QByteArray &username, const QByteArray &token)
+{
+    if (token.size() != SELECTOR_SIZE + VALIDATOR_SIZE)
+    {
+        return false;
+    }
+
+    Entry entry;
+
+    if (!lookup(token.left(SELECTOR_SIZE), entry))
+    {
+        return false;
+    }
+
+    auto verifier = hash(token.mid(SELECTOR_SIZE));
+
+    if (verifier.size() != entry.verifier.size()
+            || !VerifyBufsEqual(reinterpret_cast<const quint8 *>(verifier.constData()),
+                                reinterpret_cast<const quint8 *>(entry.verifier.constData()),
+                                verifier.size()))
+    {
+        return false;
+    }
+
+    return entry.username == username
+           && entry.expires >= QDateTime::currentSecsSinceEpoch();
+}
+
+void Sessions::revoke(const QByteArray &token)
+{
+    auto selector = token.left(SELECTOR_SIZE);
+
+    mutex.lock();
+    cache.remove(selector);
+    revoked.insert(selector, std::numeric_limits<quint64>::max());
+    mutex.unlock();
+
+    Database::Result result;
+    Database::exec("DELETE FROM SESSIONS"
+                   " WHERE SELECTOR = ?",
+    {
+        selector
+    }, result);
+
+    if (!result.ok)
+    {
+        Server::error(result.error);
+    }
+
+    QMutexLocker locker(&mutex);
+
+    revoked.insert(selector, ++generation);
+    prune();
+}
+
+QByteArray Sessions::hash(const QByteArray &validator)
+{
+    QByteArray digest(SHA3_256::DIGESTSIZE, 0);
+
+    HMAC<SHA3_256> hmac(key.constData(), key.size());
+    hmac.CalculateDigest(reinterpret_cast<quint8 *>(digest.data()),
+                         reinterpret_cast<const quint8 *>(validator.constData()),
+                         validator.size());
+
+    return digest;
+}
+
+bool Sessions::lookup(const QByteArray &selector, Entry &entry)
+{
+    auto now = QDateTime::currentSecsSinceEpoch();
+
+    mutex.lock();
+
+    auto it = cache.constFind(selector);
+    auto hit = it != cache.constEnd() && it->cached + cacheTime >= now;
+    auto start = generation;
+
+    if (hit)
+    {
+        entry = *it;
+    }
+    else
+    {
+        readers[start]++;
+    }
+
+    mutex.unlock();
+
+    if (hit)
+    {
+        Stats::add("sessions.cache_hits");
+        return true;
+    }
+
+    Stats::add("sessions.cache_misses");
+
+    Database::Result result;
+    Database::exec("SELECT USERNAME, VERIFIER, EXPIRES FROM SESSIONS"
+                   " WHERE SELECTOR = ?",
+    {
+        selector
+    }, result);
+
+    if (!result.ok)
+    {
+        Server::error(result.error);
+    }
+
+    QMutexLocker locker(&mutex);
+
+    if (--readers[start] == 0)
+    {
+        readers.remove(start);
+    }
+
+    auto stale = revoked.value(selector, 0) > start;
+
+    prune();
+
+    if (result.rows.isEmpty() || stale)
+    {
+        return false;
+    }
+
+    const auto &row = result.rows.first();
+
+    entry = Entry
+    {
+        row.at(0).toByteArray(),
+        row.at(1).toByteArray(),
+        row.at(2).toLongLong(),
+        now
+    };
+
+    if (cache.size() >= CACHE_LIMIT)
+    {
+        cache.clear();
+    }
+
+    cache.insert(selector, entry);
+
+    return true;
+}
+
+void Sessions::prune()
+{
+    auto oldest = readers.isEmpty() ? generation : readers.firstKey();
+
+    for (auto it = revoked.begin(); it != revoked.end();)
+    {
+        if (it.value() <= oldest)
+        {
+            it = revoked.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+}
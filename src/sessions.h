@@ -0,0 +1,45 @@
+#ifndef SESSIONS_H
+#define SESSIONS_H
+
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QVector>
+
+class Sessions
+{
+public:
+    static void prepare();
+
+    static qint64 getLifetime();
+
+    static QByteArray issue(const QByteArray &);
+    static bool verify(const QByteArray &, const QByteArray &);
+    static void revoke(const QByteArray &);
+
+private:
+    struct Entry
+    {
+        QByteArray username;
+        QByteArray verifier;
+        qint64 expires;
+        qint64 cached;
+    };
+
+    static QMutex mutex;
+    static QHash<QByteArray, Entry> cache;
+    static QVector<quint8> key;
+
+    static quint64 generation;
+    static QHash<QByteArray, quint64> revoked;
+    static QMap<quint64, int> readers;
+
+    static qint64 lifetime;
+    static qint64 cacheTime;
+
+    static QByteArray hash(const QByteArray &);
+    static bool lookup(const QByteArray &, Entry &);
+    static void prune();
+};
+
+#endif // SESSIONS_H
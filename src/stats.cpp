@@ -0,0 +1,226 @@
+#include "stats.h"
+#include "server.h"
+
+#include <QtDebug>
+#include <QCoreApplication>
+#include <QTimer>
+
+static constexpr int REFRESH_MS = 1000;
+
+QMutex Stats::mutex;
+QMap<QByteArray, qint64> Stats::counters;
+QMap<QByteArray, Stats::Histogram> Stats::histograms;
+QVector<QSharedPointer<Stats::Local>> Stats::locals;
+QThreadStorage<QSharedPointer<Stats::Local>> Stats::local;
+QReadWriteLock Stats::meansLock;
+QHash<QByteArray, qint64> Stats::means;
+
+void Stats::prepare()
+{
+    auto refresher = new QTimer(qApp);
+    refresher->callOnTimeout(&Stats::refresh);
+    refresher->start(REFRESH_MS);
+
+    auto interval = Server::getSettings().value("StatsInterval", 0).toInt();
+
+    if (interval < 1)
+    {
+        return;
+    }
+
+    auto timer = new QTimer(qApp);
+    timer->callOnTimeout(&Stats::report);
+    timer->start(interval * 1000);
+}
+
+void Stats::add(const char *name, qint64 delta)
+{
+    add(QByteArray::fromRawData(name, int(qstrlen(name))), delta);
+}
+
+void Stats::add(const QByteArray &name, qint64 delta)
+{
+    auto &l = getLocal();
+
+    QMutexLocker locker(&l.mutex);
+
+    auto it = l.counters.find(name);
+
+    if (it == l.counters.end())
+    {
+        it = l.counters.insert(QByteArray(name.constData(), name.size()), 0);
+    }
+
+    *it += delta;
+}
+
+void Stats::set(const QByteArray &name, qint64 value)
+{
+    QMutexLocker locker(&mutex);
+    counters[name] = value;
+}
+
+void Stats::record(const char *name, qint64 sample)
+{
+    record(QByteArray::fromRawData(name, int(qstrlen(name))), sample);
+}
+
+void Stats::record(const QByteArray &name, qint64 sample)
+{
+    sample = qMax(sample, qint64(0));
+
+    int bucket = 0;
+
+    while (bucket < 63 && (sample >> bucket) > 0)
+    {
+        bucket++;
+    }
+
+    auto &l = getLocal();
+
+    QMutexLocker locker(&l.mutex);
+
+    auto it = l.histograms.find(name);
+
+    if (it == l.histograms.end())
+    {
+        it = l.histograms.insert(QByteArray(name.constData(), name.size()), Histogram
+        {
+            QVector<qint64>(64),
+            0,
+            0,
+            0
+        });
+    }
+
+    it->buckets[bucket]++;
+    it->count++;
+    it->sum += sample;
+    it->max = qMax(it->max, sample);
+}
+
+qint64 Stats::value(const QByteArray &name)
+{
+    QMutexLocker locker(&mutex);
+    collect();
+    return counters.value(name);
+}
+
+qint64 Stats::mean(const QByteArray &name)
+{
+    QReadLocker locker(&meansLock);
+    return means.value(name);
+}
+
+Stats::Local &Stats::getLocal()
+{
+    if (!local.hasLocalData())
+    {
+        QSharedPointer<Local> l(new Local);
+        local.setLocalData(l);
+
+        QMutexLocker locker(&mutex);
+        locals.append(l);
+    }
+
+    return *local.localData();
+}
+
+void Stats::merge(Histogram &into, const Histogram &from)
+{
+    if (into.buckets.isEmpty())
+    {
+        into = from;
+        return;
+    }
+
+    for (int i = 0; i < into.buckets.size(); i++)
+    {
+        into.buckets[i] += from.buckets[i];
+    }
+
+    into.count += from.count;
+    into.sum += from.sum;
+    into.max = qMax(into.max, from.max);
+}
+
+void Stats::refresh()
+{
+    QHash<QByteArray, qint64> fresh;
+
+    mutex.lock();
+    collect();
+
+    for (auto it = histograms.constBegin(); it != histograms.constEnd(); it++)
+    {
+        fresh.insert(it.key(), it->sum / it->count);
+    }
+
+    mutex.unlock();
+
+    QWriteLocker locker(&meansLock);
+    means.swap(fresh);
+}
+
+void Stats::collect()
+{
+    for (const auto &l : qAsConst(locals))
+    {
+        QMutexLocker locker(&l->mutex);
+
+        for (auto it = l->counters.constBegin(); it != l->counters.constEnd(); it++)
+        {
+            counters[it.key()] += it.value();
+        }
+
+        for (auto it = l->histograms.constBegin(); it != l->histograms.constEnd(); it++)
+        {
+            merge(histograms[it.key()], it.value());
+        }
+
+        l->counters.clear();
+        l->histograms.clear();
+    }
+}
+
+qint64 Stats::percentile(const Histogram &histogram, int p)
+{
+    auto rank = (histogram.count * p + 99) / 100;
+    qint64 seen = 0;
+
+    for (int i = 0; i < histogram.buckets.size(); i++)
+    {
+        seen += histogram.buckets[i];
+
+        if (seen >= rank)
+        {
+            return i == 0 ? 0 : qMin((qint64(1) << i) - 1, histogram.max);
+        }
+    }
+
+    return histogram.max;
+}
+
+void Stats::report()
+{
+    QMutexLocker locker(&mutex);
+    collect();
+
+    for (auto it = counters.constBegin(); it != counters.constEnd(); it++)
+    {
+        qInfo().noquote() << QString("%1: %2")
+                          .arg(QString(it.key()))
+                          .arg(it.value());
+    }
+
+    for (auto it = histograms.constBegin(); it != histograms.constEnd(); it++)
+    {
+        qInfo().noquote() << QString("%1: count=%2 mean=%3 p50=%4 p99=%5 max=%6")
+                          .arg(QString(it.key()))
+                          .arg(it->count)
+                          .arg(it->sum / it->count)
+                          .arg(percentile(*it, 50))
+                          .arg(percentile(*it, 99))
+                          .arg(it->max);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <QHash>
+#include <QMap>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSharedPointer>
+#include <QThreadStorage>
+#include <QVector>
+
+class Stats
+{
+public:
+    static void prepare();
+
+    static void add(const char *, qint64 = 1);
+    static void add(const QByteArray &, qint64 = 1);
+    static void set(const QByteArray &, qint64);
+    static void record(const char *, qint64);
+    static void record(const QByteArray &, qint64);
+
+    static qint64 value(const QByteArray &);
+    static qint64 mean(const QByteArray &);
+
+private:
+    struct Histogram
+    {
+        QVector<qint64> buckets;
+        qint64 count;
+        qint64 sum;
+        qint64 max;
+    };
+
+    struct Local
+    {
+        QMutex mutex;
+        QHash<QByteArray, qint64> counters;
+        QHash<QByteArray, Histogram> histograms;
+    };
+
+    static QMutex mutex;
+    static QMap<QByteArray, qint64> counters;
+    static QMap<QByteArray, Histogram> histograms;
+    static QVector<QSharedPointer<Local>> locals;
+    static QThreadStorage<QSharedPointer<Local>> local;
+
+    static QReadWriteLock meansLock;
+    static QHash<QByteArray, qint64> means;
+
+    static Local &getLocal();
+    static void merge(Histogram &, const Histogram &);
+    static void collect();
+    static void refresh();
+    static qint64 percentile(const Histogram &, int);
+    static void report();
+};
+
+#endif // STATS_H
@@ -1,50 +1,206 @@
 #include "thread.h"
+#include "client.h"
+#include "server.h"
+#include "stats.h"
 
 #include <QCoreApplication>
+#include <QRandomGenerator>
+#include <QTimer>
 
-QHash<QThread *, int> Thread::attached;
-QVector<QThread *> Thread::pool;
+#ifdef Q_OS_UNIX
+#include <time.h>
+#endif
+
+QVector<Thread::Worker *> Thread::pool;
+QHash<QThread *, Thread::Worker *> Thread::workers;
+QMutex Thread::roomsMutex;
+QHash<QByteArray, QThread *> Thread::rooms;
+bool Thread::affinity = false;
+QElapsedTimer Thread::clock;
+qint64 Thread::threshold = 0;
+bool Thread::rebalanced = false;
+
+static qint64 cpuTime()
+{
+#ifdef Q_OS_UNIX
+    timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+    {
+        return qint64(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+#endif
+
+    return 0;
+}
 
 void Thread::prepare()
 {
     for (int i = 0; i < QThread::idealThreadCount(); i++)
     {
-        auto *thread = new QThread;
+        auto worker = new Worker;
+        worker->thread = new QThread;
+        worker->context = new QObject;
+        worker->context->moveToThread(worker->thread);
+        worker->usage = 0;
 
-        attached.insert(thread, 0);
-        pool.append(thread);
+        pool.append(worker);
+        workers.insert(worker->thread, worker);
     }
+
+    auto timer = new QTimer(qApp);
+    timer->callOnTimeout(&Thread::update);
+    timer->start(1000);
+
+    auto &settings = Server::getSettings();
+
+    affinity = settings.value("RoomAffinity", false).toBool();
+
+    auto interval = settings.value("RebalanceInterval", 0).toInt();
+    threshold = settings.value("RebalanceThreshold", 25).toLongLong();
+
+    if (interval < 1)
+    {
+        return;
+    }
+
+    clock.start();
+
+    auto rebalancer = new QTimer(qApp);
+    rebalancer->callOnTimeout(&Thread::rebalance);
+    rebalancer->start(interval * 1000);
 }
 
 void Thread::attach(QObject *object)
 {
-    attached[object->thread()]++;
+    auto worker = workers.value(object->thread());
+
+    worker->clients.ref();
+
+    worker->mutex.lock();
+    worker->objects.insert(object);
+    worker->mutex.unlock();
 
     QObject::connect(object, &QObject::destroyed, [ = ]
     {
-        attached[object->thread()]--;
+        auto worker = workers.value(object->thread());
+
+        worker->clients.deref();
+
+        worker->mutex.lock();
+        worker->objects.remove(object);
+        worker->mutex.unlock();
     });
 }
 
+void Thread::migrate(QObject *object, QThread *source)
+{
+    auto from = workers.value(source);
+    auto to = workers.value(object->thread());
+
+    from->clients.deref();
+    to->clients.ref();
+
+    from->mutex.lock();
+    from->objects.remove(object);
+    from->mutex.unlock();
+
+    to->mutex.lock();
+    to->objects.insert(object);
+    to->mutex.unlock();
+
+    start(object->thread());
+}
+
+void Thread::account(qint64 bytes)
+{
+    auto worker = workers.value(QThread::currentThread());
+
+    if (worker == nullptr)
+    {
+        return;
+    }
+
+    worker->packets.fetchAndAddRelaxed(1);
+    worker->bytes.fetchAndAddRelaxed(bytes);
+}
+
 QThread *Thread::get()
 {
-    QThread *thread = nullptr;
-    int min = -1;
+    auto first = pool.at(QRandomGenerator::global()->bounded(pool.size()));
+    auto second = pool.at(QRandomGenerator::global()->bounded(pool.size()));
+
+    auto thread = load(first) <= load(second)
+                  ? first->thread
+                  : second->thread;
+
+    start(thread);
 
-    for (auto it = attached.begin(); it != attached.end(); it++)
+    return thread;
+}
+
+QVector<QThread *> Thread::all()
+{
+    QVector<QThread *> threads;
+
+    for (const auto &worker : pool)
     {
-        if (min > it.value() || min == -1)
-        {
-            thread = it.key();
-            min = it.value();
-        }
+        start(worker->thread);
+        threads.append(worker->thread);
+    }
 
-        if (min == 0)
-        {
-            break;
-        }
+    return threads;
+}
+
+qint64 Thread::getLoad(QThread *thread)
+{
+    auto worker = workers.value(thread);
+
+    if (worker == nullptr)
+    {
+        return 0;
+    }
+
+    return load(worker);
+}
+
+bool Thread::hasRoomAffinity()
+{
+    return affinity;
+}
+
+QThread *Thread::getForRoom(const QByteArray &room)
+{
+    QMutexLocker locker(&roomsMutex);
+
+    auto thread = rooms.value(room);
+
+    if (thread == nullptr)
+    {
+        thread = get();
+        rooms.insert(room, thread);
     }
 
+    return thread;
+}
+
+void Thread::releaseRoom(const QByteArray &room)
+{
+    QMutexLocker locker(&roomsMutex);
+
+    if (Server::participants.values(room)->isEmpty())
+    {
+        rooms.remove(room);
+    }
+}
+
+qint64 Thread::load(const Worker *worker)
+{
+    return worker->clients.load() + worker->rate.load();
+}
+
+void Thread::start(QThread *thread)
+{
     if (!thread->isRunning())
     {
         thread->start();
@@ -55,6 +211,125 @@ QThread *Thread::get()
             thread->wait();
         });
     }
+}
 
-    return thread;
+void Thread::update()
+{
+    for (int i = 0; i < pool.size(); i++)
+    {
+        auto worker = pool.at(i);
+
+        auto packets = worker->packets.fetchAndStoreRelaxed(0);
+        auto bytes = worker->bytes.fetchAndStoreRelaxed(0);
+
+        worker->rate.store((worker->rate.load() * 3 + packets + bytes / 1024) / 4);
+
+        Stats::set("thread." + QByteArray::number(i) + ".clients", worker->clients.load());
+        Stats::set("thread." + QByteArray::number(i) + ".load", load(worker));
+    }
+}
+
+void Thread::rebalance()
+{
+    auto elapsed = clock.nsecsElapsed();
+    clock.restart();
+
+    Worker *hottest = nullptr;
+    Worker *coolest = nullptr;
+    qint64 max = 0;
+    qint64 min = 0;
+
+    for (int i = 0; i < pool.size(); i++)
+    {
+        auto worker = pool.at(i);
+
+        if (!worker->thread->isRunning())
+        {
+            continue;
+        }
+
+        auto cpu = worker->cpu.load();
+        auto busy = elapsed > 0 ? (cpu - worker->usage) * 100 / elapsed : 0;
+        auto score = busy + worker->lag.load() / 1000;
+
+        worker->usage = cpu;
+
+        Stats::set("thread." + QByteArray::number(i) + ".cpu", busy);
+        Stats::set("thread." + QByteArray::number(i) + ".lag_us", worker->lag.load());
+
+        if (hottest == nullptr || score > max)
+        {
+            hottest = worker;
+            max = score;
+        }
+
+        if (coolest == nullptr || score < min)
+        {
+            coolest = worker;
+            min = score;
+        }
+
+        QElapsedTimer posted;
+        posted.start();
+
+        QMetaObject::invokeMethod(worker->context, [ = ]
+        {
+            worker->lag.store(posted.nsecsElapsed() / 1000);
+            worker->cpu.store(cpuTime());
+        }, Qt::QueuedConnection);
+    }
+
+    if (rebalanced)
+    {
+        Stats::set("rebalance.imbalance_after", max - min);
+        rebalanced = false;
+    }
+
+    if (hottest == coolest || max - min < threshold)
+    {
+        return;
+    }
+
+    Stats::set("rebalance.imbalance_before", max - min);
+    rebalanced = true;
+
+    auto target = coolest->thread;
+
+    QMetaObject::invokeMethod(hottest->context, [ = ]
+    {
+        offload(hottest, target);
+    }, Qt::QueuedConnection);
+}
+
+void Thread::offload(Worker *worker, QThread *target)
+{
+    worker->mutex.lock();
+    auto objects = worker->objects;
+    worker->mutex.unlock();
+
+    Client *candidate = nullptr;
+    qint64 max = -1;
+
+    for (const auto &object : objects)
+    {
+        auto client = qobject_cast<Client *>(object);
+
+        if (client == nullptr)
+        {
+            continue;
+        }
+
+        auto traffic = client->takeTraffic();
+
+        if (traffic > max && client->isMigratable() && !client->isPinned())
+        {
+            candidate = client;
+            max = traffic;
+        }
+    }
+
+    if (candidate != nullptr && candidate->migrate(target))
+    {
+        Stats::add("rebalance.migrations");
+    }
 }
@@ -1,7 +1,11 @@
 #ifndef THREAD_H
 #define THREAD_H
 
+#include <QAtomicInteger>
+#include <QElapsedTimer>
 #include <QHash>
+#include <QMutex>
+#include <QSet>
 #include <QThread>
 #include <QVector>
 
@@ -11,11 +15,50 @@ public:
     static void prepare();
 
     static void attach(QObject *);
+    static void migrate(QObject *, QThread *);
+    static void account(qint64);
+
     static QThread *get();
+    static QVector<QThread *> all();
+
+    static qint64 getLoad(QThread *);
+
+    static bool hasRoomAffinity();
+    static QThread *getForRoom(const QByteArray &);
+    static void releaseRoom(const QByteArray &);
 
 private:
-    static QHash<QThread *, int> attached;
-    static QVector<QThread *> pool;
+    struct Worker
+    {
+        QThread *thread;
+        QObject *context;
+        QMutex mutex;
+        QSet<QObject *> objects;
+        QAtomicInteger<qint64> clients;
+        QAtomicInteger<qint64> packets;
+        QAtomicInteger<qint64> bytes;
+        QAtomicInteger<qint64> rate;
+        QAtomicInteger<qint64> cpu;
+        QAtomicInteger<qint64> lag;
+        qint64 usage;
+    };
+
+    static QVector<Worker *> pool;
+    static QHash<QThread *, Worker *> workers;
+
+    static QMutex roomsMutex;
+    static QHash<QByteArray, QThread *> rooms;
+    static bool affinity;
+
+    static QElapsedTimer clock;
+    static qint64 threshold;
+    static bool rebalanced;
+
+    static qint64 load(const Worker *);
+    static void start(QThread *);
+    static void update();
+    static void rebalance();
+    static void offload(Worker *, QThread *);
 };
 
 #endif // THREAD_H
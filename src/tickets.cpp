@@ -0,0 +1,212 @@
+#include "tickets.h"
+#include "server.h"
+
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QDateTime>
+#include <QTimer>
+
+#include <cryptopp/chachapoly.h>
+#include <cryptopp/osrng.h>
+using CryptoPP::AutoSeededRandomPool;
+using CryptoPP::XChaCha20Poly1305;
+
+static constexpr int KEY_SIZE = 32;
+static constexpr int HEADER_SIZE = 4;
+static constexpr int IV_SIZE = 24;
+static constexpr int TAG_SIZE = 16;
+static constexpr int HOLDERS_LIMIT = 65536;
+
+QReadWriteLock Tickets::lock;
+QMap<quint32, Tickets::Key> Tickets::keys;
+quint32 Tickets::current = 0;
+QMutex Tickets::holdersMutex;
+QHash<QHostAddress, qint64> Tickets::holders;
+qint64 Tickets::lifetime = 0;
+qint64 Tickets::rotation = 0;
+
+void Tickets::prepare()
+{
+    auto &settings = Server::getSettings();
+
+    lifetime = settings.value("TicketLifetime", 86400).toLongLong();
+    rotation = settings.value("TicketRotation", 3600).toLongLong();
+
+    if (lifetime < 1)
+    {
+        return;
+    }
+
+    rotate();
+
+    if (rotation < 1)
+    {
+        return;
+    }
+
+    auto timer = new QTimer(qApp);
+    timer->callOnTimeout(&Tickets::rotate);
+    timer->start(rotation * 1000);
+}
+
+qint64 Tickets::getLifetime()
+{
+    return lifetime;
+}
+
+QByteArray Tickets::issue(const QVector<quint8> &secret)
+{
+    QReadLocker locker(&lock);
+
+    if (keys.isEmpty())
+    {
+        return {};
+    }
+
+    auto id = current;
+    auto key = keys.value(id).secret;
+
+    locker.unlock();
+
+    QByteArray ticket;
+    QDataStream ds(&ticket, QIODevice::WriteOnly);
+
+    ds << id;
+
+    ticket.resize(HEADER_SIZE + IV_SIZE + TAG_SIZE);
+
+    ds.device()->seek(ticket.size());
+    ds << QDateTime::currentSecsSinceEpoch() + lifetime
+       << secret;
+
+    auto data = reinterpret_cast<quint8 *>(ticket.data());
+
+    AutoSeededRandomPool rng;
+    rng.GenerateBlock(data + HEADER_SIZE, IV_SIZE);
+
+    XChaCha20Poly1305::Encryption enc;
+    enc.SetKeyWithIV(key.constData(), key.size(),
+                     data + HEADER_SIZE, IV_SIZE);
+    enc.EncryptAndAuthenticate(data + HEADER_SIZE + IV_SIZE + TAG_SIZE,
+                               data + HEADER_SIZE + IV_SIZE, TAG_SIZE,
+                               data + HEADER_SIZE, IV_SIZE,
+                               data, HEADER_SIZE,
+                               data + HEADER_SIZE + IV_SIZE + TAG_SIZE,
+                               ticket.size() - HEADER_SIZE - IV_SIZE - TAG_SIZE);
+
+    return ticket;
+}
+
+QVector<quint8> Tickets::redeem(const QByteArray &ticket)
+{
+    if (ticket.size() <= HEADER_SIZE + IV_SIZE + TAG_SIZE)
+    {
+        return {};
+    }
+
+    QByteArray copy(ticket);
+    QDataStream ds(&copy, QIODevice::ReadOnly);
+
+    quint32 id;
+    ds >> id;
+
+    QReadLocker locker(&lock);
+
+    if (!keys.contains(id))
+    {
+        return {};
+    }
+
+    auto key = keys.value(id).secret;
+
+    locker.unlock();
+
+    auto data = reinterpret_cast<quint8 *>(copy.data());
+
+    XChaCha20Poly1305::Decryption dec;
+    dec.SetKeyWithIV(key.constData(), key.size(),
+                     data + HEADER_SIZE, IV_SIZE);
+
+    if (!dec.DecryptAndVerify(data + HEADER_SIZE + IV_SIZE + TAG_SIZE,
+                              data + HEADER_SIZE + IV_SIZE, TAG_SIZE,
+                              data + HEADER_SIZE, IV_SIZE,
+                              data, HEADER_SIZE,
+                              data + HEADER_SIZE + IV_SIZE + TAG_SIZE,
+                              copy.size() - HEADER_SIZE - IV_SIZE - TAG_SIZE))
+    {
+        return {};
+    }
+
+    qint64 expires;
+    QVector<quint8> secret;
+
+    ds.device()->seek(HEADER_SIZE + IV_SIZE + TAG_SIZE);
+    ds >> expires
+       >> secret;
+
+    if (ds.status() != QDataStream::Ok
+            || expires < QDateTime::currentSecsSinceEpoch())
+    {
+        return {};
+    }
+
+    return secret;
+}
+
+void Tickets::remember(const QHostAddress &address)
+{
+    QMutexLocker locker(&holdersMutex);
+
+    if (holders.size() >= HOLDERS_LIMIT)
+    {
+        holders.clear();
+    }
+
+    holders.insert(address, QDateTime::currentSecsSinceEpoch() + lifetime);
+}
+
+bool Tickets::isExpected(const QHostAddress &address)
+{
+    QMutexLocker locker(&holdersMutex);
+
+    auto it = holders.find(address);
+
+    if (it == holders.end())
+    {
+        return false;
+    }
+
+    if (*it < QDateTime::currentSecsSinceEpoch())
+    {
+        holders.erase(it);
+        return false;
+    }
+
+    return true;
+}
+
+void Tickets::rotate()
+{
+    Key key;
+    key.secret.resize(KEY_SIZE);
+    key.created = QDateTime::currentSecsSinceEpoch();
+
+    AutoSeededRandomPool rng;
+    rng.GenerateBlock(key.secret.data(), key.secret.size());
+
+    QWriteLocker locker(&lock);
+
+    for (auto it = keys.begin(); it != keys.end();)
+    {
+        if (it->created + rotation + lifetime < key.created)
+        {
+            it = keys.erase(it);
+        }
+        else
+        {
+            it++;
+        }
+    }
+
+    keys.insert(++current, key);
+}
@@ -0,0 +1,44 @@
+#ifndef TICKETS_H
+#define TICKETS_H
+
+#include <QHash>
+#include <QHostAddress>
+#include <QMap>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QVector>
+
+class Tickets
+{
+public:
+    static void prepare();
+
+    static qint64 getLifetime();
+
+    static QByteArray issue(const QVector<quint8> &);
+    static QVector<quint8> redeem(const QByteArray &);
+
+    static void remember(const QHostAddress &);
+    static bool isExpected(const QHostAddress &);
+
+private:
+    struct Key
+    {
+        QVector<quint8> secret;
+        qint64 created;
+    };
+
+    static QReadWriteLock lock;
+    static QMap<quint32, Key> keys;
+    static quint32 current;
+
+    static QMutex holdersMutex;
+    static QHash<QHostAddress, qint64> holders;
+
+    static qint64 lifetime;
+    static qint64 rotation;
+
+    static void rotate();
+};
+
+#endif // TICKETS_H